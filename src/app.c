@@ -2,6 +2,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include "app.h"
+#include "utils/romfile.h"
 #ifdef NO_FILE_LOAD
     #include "rom.h"
 #endif
@@ -109,6 +110,16 @@ void drop_callback (GLFWwindow * window, int count, const char** paths)
 
     LOG_("%s\n", paths[0]);
     strcpy(app->defaultFile, paths[0]);
+#ifdef USE_JIT
+    gb_jit_free (&app->gb);
+#endif
+    /* Save and release the current cart, which nothing runs if the new one fails */
+    app_save_close (app);
+#ifndef NO_FILE_LOAD
+    rom_file_close (app->gb.cart.romData);
+    app->gb.cart.romData = NULL;
+#endif
+    app->paused = 1;
 
     /* Copy ROM to cart */
     if (app_load(&app->gb, app->defaultFile))
@@ -116,6 +127,7 @@ void drop_callback (GLFWwindow * window, int count, const char** paths)
         app->gb.extData.ptr = &app->gbData;
         app->gbData.palette = gbcChecksumPalettes[app->gb.cart.checksum] * 3;
         app->paused = 0;
+        app_save_open (app);
     }
     else app->defaultFile[0] = '\0';
 }
@@ -212,11 +224,27 @@ void app_config (struct App * app, uint8_t const argc, char * const argv[])
     app->debug = app->step = 0;
 }
 
+#ifdef USE_GLFW
+/* Colors for each pixel value, from the palettes in use */
+
+static void app_frame_colors (struct gb_data * const data)
+{
+    uint8_t p;
+    for (p = 0; p < 16; p++)
+    {
+        const uint8_t pal = (p >> 2) & 3;
+        memcpy (data->colors[p], manualPalettes[data->palette + (pal ? pal - 1 : 0)].colors[(3 - p) & 3], 3);
+        data->colors[p][3] = 0xFF;
+    }
+}
+#endif
+
 void app_init (struct App * app)
 {    
     /* Define structs for data and concrete functions */
     app->gb.cart.romData = NULL;
     app->gb.cart.ramData = NULL;
+    app->save.data = NULL;
 
     app->gbData = (struct gb_data) 
     {
@@ -238,6 +266,7 @@ void app_init (struct App * app)
     /* Frameskip (for slower FPS) */
     app->gb.extData.frameSkip = 0;
     app->gb.extData.interlace = 0;
+    app->gb.extData.oamOrder = 0;
 
     /* Handle file loading */
 #ifndef NO_FILE_LOAD
@@ -252,13 +281,28 @@ void app_init (struct App * app)
             app->gb.extData.ptr = &app->gbData;
             app->gbData.palette = gbcChecksumPalettes[app->gb.cart.checksum] * 3;
             app->paused = 0;
+            app_save_open (app);
         }
         else app->defaultFile[0] = '\0';
     }
 
     /* Assign functions to be used by emulator */
-    app->gb.cart.rom_read = app_cart_rom_read;
     app->gb.draw_line     = app_draw_line;
+#if defined(USE_GLFW)
+    /* Whole frames are drawn in RGB, and shown as they're finished */
+    app->gbData.frames[0] = app->gbData.frameBuffer.imgData;
+    app->gbData.frames[1] = calloc (DISPLAY_WIDTH * DISPLAY_HEIGHT * 3, sizeof(uint8_t));
+    app_frame_colors (&app->gbData);
+
+    app->gb.frameOut.buffers[0] = app->gbData.frames[0];
+    app->gb.frameOut.buffers[1] = app->gbData.frames[1];
+    app->gb.frameOut.colors = (const uint8_t (*)[4]) app->gbData.colors;
+    app->gb.frameOut.count  = 2;
+    app->gb.frameOut.format = GB_FRAME_RGB;
+    app->gb.frame_ready   = app_frame_ready;
+#else
+    app->gb.frame_ready   = NULL;
+#endif
 
 #ifdef ENABLE_AUDIO
     app_audio_init(app);
@@ -319,27 +363,12 @@ uint8_t * app_load (struct GB * gb, const char * fileName)
 #ifndef NO_FILE_LOAD
 
     LOG_("Attempting to open \"%s\"...\n", fileName);
-    FILE * f = fopen (fileName, "rb");
-
-    uint8_t * rom = NULL;
-    if (!f) {
+    size_t romSize;
+    uint8_t * rom = rom_file_open (fileName, &romSize);
+    if (!rom) {
         LOG_("Failed to load file \"%s\"\n", fileName);
         return NULL;
     }
-    else {
-        LOG_("Attempting to seek file \"%s\"\n", fileName);
-        fseek (f, 0, SEEK_END);
-        uint32_t size = ftell(f);
-        fseek (f, 0, SEEK_SET);
-
-        rom = malloc(size + 1);
-        if (!fread (rom, size, 1, f))
-            return NULL;
-        fclose (f);
-
-        /* End with null character */
-        rom[size] = 0;
-    }
     uint8_t * boot = NULL;
 
 #ifdef  USE_BOOT_ROM
@@ -361,6 +390,7 @@ uint8_t * app_load (struct GB * gb, const char * fileName)
     /* Copy ROM to cart */
     LOG_("Loading \"%s\"\n", fileName);
     gb->cart.romData = rom;
+    gb->cart.romSize = romSize;
     if (gb->cart.romData)
         gb_init (gb, boot);
 
@@ -370,6 +400,7 @@ uint8_t * app_load (struct GB * gb, const char * fileName)
 
     LOG_("Loading default: \"%s\"\n", "gb240p.gb");
     gb->cart.romData = rom_gb240p_gb;
+    gb->cart.romSize = 0; /* Built in, so not checked */
     if (gb->cart.romData) 
         gb_init (gb, boot);
 
@@ -377,11 +408,77 @@ uint8_t * app_load (struct GB * gb, const char * fileName)
 #endif
 }
 
-uint8_t app_cart_rom_read (void * dataPtr, const uint32_t addr)
+/* Keep battery-backed RAM in a .sav file named after the ROM, followed
+   by the clock state for MBC3 carts with a clock. Close the save of the
+   previous ROM first; the cart now has its own RAM and clock */
+
+void app_save_open (struct App * app)
+{
+    struct Cartridge * const cart = &app->gb.cart;
+    const size_t ramSize = cart->ramData ? cart->ramSizeKB * 1024 : 0;
+    char fileName[sizeof (app->defaultFile) + 4];
+
+    save_file_close (&app->save, cart->ramDirty);
+    if (!cart->battery || !(ramSize || cart->rtc) || app->defaultFile[0] == '\0')
+        return;
+
+    strcpy (fileName, app->defaultFile);
+    char * const ext = strrchr (fileName, '.');
+    if (ext && !strpbrk (ext, "/\\"))
+        *ext = '\0';
+    strcat (fileName, ".sav");
+
+    if (save_file_open (&app->save, fileName, ramSize + (cart->rtc ? RTC_SAVE_SIZE : 0)))
+    {
+        LOG_("Using save file \"%s\"\n", fileName);
+        if (ramSize)
+        {
+            free (cart->ramData);
+            gb_cart_ram (&app->gb, app->save.data);
+        }
+        if (cart->rtc)
+            cart_rtc_load (cart, app->save.data + ramSize);
+    }
+}
+
+/* Store the clock state, then write back any changes to the save file */
+
+void app_save_sync (struct App * app, const uint8_t wait)
+{
+    struct Cartridge * const cart = &app->gb.cart;
+
+    if (!app->save.data)
+        return;
+    if (cart->rtc)
+    {
+        const size_t offset = app->save.size - RTC_SAVE_SIZE;
+        const size_t block  = offset / RAM_DIRTY_BLOCK;
+
+        cart_rtc_save (cart, app->save.data + offset);
+        cart->ramDirty[block >> 3] |= 1 << (block & 7);
+    }
+    save_file_sync (&app->save, cart->ramDirty, wait);
+    gb_mem_map_rom (&app->gb); /* Saved blocks are written through the MBC again */
+}
+
+/* Write back and close the save file, then free the cart RAM if it was
+   not the save. Call before loading another ROM or exiting */
+
+void app_save_close (struct App * app)
 {
-    struct Cartridge * const cart = dataPtr;
+    struct Cartridge * const cart = &app->gb.cart;
+
+    if (app->save.data)
+    {
+        const uint8_t ownRAM = cart->ramData != app->save.data;
 
-    return cart->romData[addr];
+        app_save_sync (app, 1);
+        save_file_close (&app->save, cart->ramDirty);
+        if (!ownRAM)
+            cart->ramData = NULL;
+    }
+    free (cart->ramData);
+    cart->ramData = NULL;
 }
 
 void app_draw_line (void * dataPtr, const uint8_t * pixels, const uint8_t line)
@@ -405,6 +502,17 @@ void app_draw_line (void * dataPtr, const uint8_t * pixels, const uint8_t line)
 #endif
 }
 
+void app_frame_ready (void * dataPtr, uint8_t * frame)
+{
+#ifdef USE_GLFW
+    struct gb_data * const data = dataPtr;
+
+    /* Show the finished frame, and pick up any palette switch for the next */
+    data->frameBuffer.imgData = frame;
+    app_frame_colors (data);
+#endif
+}
+
 void app_draw (struct App * app)
 {
 #ifdef USE_GLFW
@@ -533,6 +641,8 @@ void app_run (struct App * app)
                 totalTime += (double)(clock() - time) / CLOCKS_PER_SEC;
                 //accu_nsec += as_nanoseconds(&finish) - as_nanoseconds(&start);
                 ++frames;
+                if (frames % SAVE_SYNC_FRAMES == 0)
+                    app_save_sync (app, 0);
                 if (frames % 30 == 29)
                 {
 #ifdef USE_GLFW
@@ -553,10 +663,15 @@ void app_run (struct App * app)
         lastUpdate = current;
     }
 
+    /* The save is closed first, as syncing it remaps the ROM pages */
+    app_save_close (app);
+#ifdef USE_JIT
+    gb_jit_free (&app->gb);
+#endif
 #ifndef NO_FILE_LOAD
-    free (app->gb.cart.romData);
+    rom_file_close (app->gb.cart.romData);
+    app->gb.cart.romData = NULL;
 #endif
-    free (app->gb.cart.ramData);
 
     const double totalSeconds = (double)(frames / 60.0);
     //const double totalTime    = (double)(accu_nsec / 1000000000.0);
@@ -7,6 +7,7 @@
 #include "app_settings.h"
 #include "gb.h"
 #include "palettes.h"
+#include "utils/savefile.h"
 
 #define USE_BOOT_ROM__
 
@@ -34,6 +35,11 @@ struct App
         /* Used for drawing the display and tilemap */
         struct Texture tileMap;
         struct Texture frameBuffer;
+
+        /* Frames the emulator draws into in turn, the last one finished
+           being shown. Colors are its own for each pixel value */
+        uint8_t * frames[2];
+        uint8_t colors[16][4];
 #endif
 #ifdef USE_TIGR
         Tigr * tileMap;
@@ -47,6 +53,9 @@ struct App
     /* Pointers to main and debug functions */
     struct GB gb;
 
+    /* Battery-backed cartridge RAM */
+    struct SaveFile save;
+
 #ifdef ENABLE_AUDIO
     ma_device audioDevice;
 #endif
@@ -68,14 +77,17 @@ uint8_t * app_load (struct GB *, const char * romName);
 void app_config (struct App *, uint8_t const argc, char * const argv[]);
 void app_init   (struct App *);
 void app_run    (struct App *);
+void app_save_open (struct App *);
+void app_save_sync (struct App *, const uint8_t wait);
+void app_save_close (struct App *);
 
 #ifdef ENABLE_AUDIO
 void app_audio_init (struct App *);
 #endif
 
 /* Functions that reference frontend app data from emulator */
-uint8_t app_cart_rom_read (void * dataPtr, const uint32_t addr);
 void    app_draw_line     (void * dataPtr, const uint8_t * pixels, const uint8_t line);
+void    app_frame_ready   (void * dataPtr, uint8_t * frame);
 
 #if defined(USE_GLFW)
 /* Drawing functions */
@@ -2,6 +2,11 @@
 #define DEBUG_TEXTURE_H  288
 #define DEFAULT_SCALE    3
 
+/* Frames between writing back battery RAM changes to the save file */
+#ifndef SAVE_SYNC_FRAMES
+    #define SAVE_SYNC_FRAMES 600
+#endif
+
 #ifdef ENABLE_AUDIO
     #define MINIAUDIO_IMPLEMENTATION
     #include "../deps/miniaudio/extras/miniaudio_split/miniaudio.h"
@@ -30,7 +35,8 @@
     #define GBE_POLL_EVENTS()       glfwPollEvents()
     #define GBE_APP_CLEANUP()\
         free (app->gbData.tileMap.imgData);\
-        free (app->gbData.frameBuffer.imgData);\
+        free (app->gbData.frames[0]);\
+        free (app->gbData.frames[1]);\
         glfwDestroyWindow (app->window);\
         glfwTerminate();\
 
@@ -5,54 +5,54 @@
 #define ENABLE_SOUND 0
 
 #include <errno.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include "../gb.h"
+#include "../jit.h"
+#include "../utils/romfile.h"
 
 const uint_fast32_t frames_per_run = 32 * 1024;
 
+/* Frames are timed in CPU time, or in real time when drawing on another
+   thread, as CPU time would add up both threads */
+
+static double bench_time ()
+{
+#ifdef USE_RENDER_THREAD
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
 /* Container for GB emulation data */
 struct gb_data
 {  
     uint8_t palette;
     uint8_t frameBuffer[DISPLAY_WIDTH * DISPLAY_HEIGHT * 3];
-}
-gbData;
-
-uint8_t app_cart_rom_read (void * dataPtr, const uint32_t addr)
-{
-    struct Cartridge * const cart = dataPtr;
 
-    return cart->romData[addr];
+    /* Used instead when frames are drawn by the emulator */
+    uint8_t frames[2][DISPLAY_WIDTH * DISPLAY_HEIGHT * 3];
+    uint8_t colors[16][4];
+    uint8_t * frame;
 }
+gbData;
 
 uint8_t * app_load (struct GB * gb, const char * fileName)
 { 
     /* Load file from command line */
     LOG_("Attempting to open \"%s\"...\n", fileName);
-    FILE * f = fopen (fileName, "rb");
-
-    uint8_t * rom = NULL;
-    if (!f) {
+    size_t romSize;
+    uint8_t * rom = rom_file_open (fileName, &romSize);
+    if (!rom) {
         LOG_("Failed to load file \"%s\"\n", fileName);
         return NULL;
     }
-    else {
-        LOG_("Attempting to seek file \"%s\"\n", fileName);
-        fseek (f, 0, SEEK_END);
-        uint32_t size = ftell(f);
-        fseek (f, 0, SEEK_SET);
-
-        rom = malloc(size + 1);
-        if (!fread (rom, size, 1, f))
-            return NULL;
-        fclose (f);
-
-        /* End with null character */
-        rom[size] = 0;
-    }
     uint8_t * boot = NULL;
 
 #ifdef  USE_BOOT_ROM
@@ -68,6 +68,7 @@ uint8_t * app_load (struct GB * gb, const char * fileName)
     /* Copy ROM to cart */
     LOG_("Loading \"%s\"\n", fileName);
     gb->cart.romData = rom;
+    gb->cart.romSize = romSize;
     if (gb->cart.romData)
         gb_init (gb, boot);
 
@@ -117,22 +118,532 @@ static void app_draw_line (void * dataPtr, const uint8_t * pixels, const uint8_t
     return;
 }
 
+static void app_frame_ready (void * dataPtr, uint8_t * frame)
+{
+    struct gb_data * const data = dataPtr;
+    data->frame = frame;
+}
+
+/* Draw whole frames in RGB, with the same colors as app_draw_line */
+
+static void app_frame_output (struct GB * gb)
+{
+    struct gb_data * const data = &gbData;
+    uint8_t p;
+
+    for (p = 0; p < 16; p++)
+    {
+        const uint8_t pal = (p >> 2) & 3;
+        memcpy (data->colors[p], palettes[pal ? pal - 1 : 0].colors[(3 - p) & 3], 3);
+        data->colors[p][3] = 0xFF;
+    }
+    gb->frameOut.buffers[0] = data->frames[0];
+    gb->frameOut.buffers[1] = data->frames[1];
+    gb->frameOut.colors = (const uint8_t (*)[4]) data->colors;
+    gb->frameOut.count  = 2;
+    gb->frameOut.format = GB_FRAME_RGB;
+    gb->frame_ready = app_frame_ready;
+}
+
+/* Field offsets and sizes of the emulator state, in the style of pahole */
+
+struct gb_field
+{
+    const char * name;
+    size_t offset, size;
+};
+
+#define GB_FIELD(F)  { #F, offsetof(struct GB, F), sizeof(((struct GB *)0)->F) }
+
+static void bench_layout_report ()
+{
+    static const struct gb_field fields[] =
+    {
+        GB_FIELD(af), GB_FIELD(bc), GB_FIELD(de), GB_FIELD(hl), GB_FIELD(flags),
+        GB_FIELD(pc), GB_FIELD(sp), GB_FIELD(nn), GB_FIELD(rm), GB_FIELD(rt),
+        GB_FIELD(clock_t), GB_FIELD(nextEvent),
+#ifdef USE_LAZY_FLAGS
+        GB_FIELD(lazyRes), GB_FIELD(lazyOp), GB_FIELD(lazyX),
+#endif
+#ifdef USE_BLOCK_CACHE
+        GB_FIELD(block), GB_FIELD(fetchOp), GB_FIELD(blockPC), GB_FIELD(fetchPC),
+        GB_FIELD(blockIdx),
+#endif
+        GB_FIELD(ppuNext), GB_FIELD(readPage), GB_FIELD(writePage),
+        GB_FIELD(io), GB_FIELD(hram), GB_FIELD(ppuClock), GB_FIELD(lineClock),
+        GB_FIELD(timerClock), GB_FIELD(eventTime),
+#ifdef USE_IDLE_SKIP
+        GB_FIELD(idleBlock), GB_FIELD(idleRegs),
+#endif
+        GB_FIELD(ram), GB_FIELD(vram), GB_FIELD(oam),
+        GB_FIELD(tiles), GB_FIELD(tileDirty),
+        GB_FIELD(lineSprites), GB_FIELD(lineSpriteCount), GB_FIELD(lineBuf),
+#ifdef USE_BLOCK_CACHE
+        GB_FIELD(blocks), GB_FIELD(codeGen), GB_FIELD(codeMap),
+#endif
+#ifdef ENABLE_AUDIO
+        GB_FIELD(audioCh),
+#endif
+        GB_FIELD(cart), GB_FIELD(bootRom), GB_FIELD(extData), GB_FIELD(frameOut),
+        GB_FIELD(draw_line), GB_FIELD(frame_ready), GB_FIELD(debug_cpu_log)
+    };
+
+    const size_t count = sizeof(fields) / sizeof(fields[0]);
+    size_t i;
+
+    printf("struct GB {             offset   size  line\n");
+    for (i = 0; i < count; i++)
+        printf("    %-16s /* %6lu %6lu %5lu */\n", fields[i].name,
+            (unsigned long)fields[i].offset, (unsigned long)fields[i].size,
+            (unsigned long)(fields[i].offset / CACHE_LINE_SIZE));
+
+    printf("    /* size: %lu, cachelines: %lu */\n};\n",
+        (unsigned long)sizeof(struct GB),
+        (unsigned long)((sizeof(struct GB) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE));
+}
+
+/* Short instruction sequences, timed on the CPU alone. Immediate
+   operands are read from work RAM, which holds zeroes. */
+
+struct bench_seq
+{
+    const char * name;
+    uint8_t count;
+    uint8_t ops[3];
+};
+
+static const struct bench_seq sequences[] =
+{
+    { "ADD A,B",          1, { 0x80 } },
+    { "ADC A,C",          1, { 0x89 } },
+    { "SUB D",            1, { 0x92 } },
+    { "SBC A,E",          1, { 0x9B } },
+    { "AND B",            1, { 0xA0 } },
+    { "XOR C",            1, { 0xA9 } },
+    { "OR D",             1, { 0xB2 } },
+    { "CP E",             1, { 0xBB } },
+    { "INC B",            1, { 0x04 } },
+    { "DEC C",            1, { 0x0D } },
+    { "ADD A,n",          1, { 0xC6 } },
+    { "CP n",             1, { 0xFE } },
+    { "ADD; ADC; SBC",    3, { 0x80, 0x89, 0x9A } },
+    { "DEC B; JR NZ",     2, { 0x05, 0x20 } },
+    { "CP n; JR Z",       2, { 0xFE, 0x28 } },
+    { "ADD A,B; DAA",     2, { 0x80, 0x27 } },
+    { "OR A; PUSH AF",    2, { 0xB7, 0xF5 } }
+};
+
+static void bench_opcodes (struct GB * gb)
+{
+    const uint32_t passes = 10 * 1000 * 1000;
+    const size_t count = sizeof(sequences) / sizeof(sequences[0]);
+    size_t i;
+
+    printf("Opcode timings (%lu passes each):\n", (unsigned long)passes);
+    for (i = 0; i < count; i++)
+    {
+        const struct bench_seq * seq = &sequences[i];
+        const clock_t start_time = clock();
+        uint32_t n;
+        uint8_t j;
+
+        for (n = 0; n < passes; n++)
+        {
+            for (j = 0; j < seq->count; j++)
+            {
+                gb->pc = 0xC000;
+                gb->sp = 0xE000;
+                gb->rm = 0;
+                gb_cpu_exec (gb, seq->ops[j]);
+            }
+        }
+        {
+            const double duration = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+            printf("    %-16s %7.2f ns\n", seq->name, duration * 1e9 / passes);
+        }
+    }
+}
+
+/* Time the step loop around a single JR -2 in work RAM. Events still run
+   on schedule, but interrupts stay disabled in IE */
+
+static void bench_steps (struct GB * gb)
+{
+    const uint32_t steps = 50 * 1000 * 1000;
+    const clock_t start_time = clock();
+    uint32_t n;
+
+    gb->ram[0] = 0x18; /* JR -2 */
+    gb->ram[1] = 0xFE;
+    gb->pc  = 0xC000;
+    gb->ime = 1;
+
+    for (n = 0; n < steps; n++)
+        gb_step (gb);
+    {
+        const double duration = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+        printf("Step loop (%lu steps):\n", (unsigned long)steps);
+        printf("    %-16s %7.2f ns\n", "JR -2", duration * 1e9 / steps);
+    }
+}
+
+/* Time drawing single lines, after running the ROM for a while so VRAM,
+   OAM and the LCD registers hold a typical frame */
+
+static void bench_lines (struct GB * gb)
+{
+    const uint32_t passes = 20 * 1000;
+    uint32_t n;
+    uint8_t ly;
+
+    for (n = 0; n < 60; n++)
+        gb_frame (gb);
+
+    const uint8_t lastLY = gb->io[LY].r;
+    const uint8_t lastWindowLY = gb->windowLY;
+    const clock_t start_time = clock();
+
+    for (n = 0; n < passes; n++)
+    {
+        gb->windowLY = 0;
+        for (ly = 0; ly < DISPLAY_HEIGHT; ly++)
+        {
+            gb->io[LY].r = ly;
+            gb_pixels_fetch (gb);
+        }
+    }
+    gb->io[LY].r = lastLY;
+    gb->windowLY = lastWindowLY;
+    {
+        const double duration = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+        printf("Line drawing (%lu frames):\n", (unsigned long)passes);
+        printf("    %-16s %7.2f ns\n", "gb_pixels_fetch", duration * 1e9 / passes / DISPLAY_HEIGHT);
+    }
+}
+
+#ifdef USE_JIT
+
+/* Run random blocks natively and in the interpreter, from the same
+   state, and compare the results. Blocks are written to work RAM, and
+   addresses mostly point back into it, with the rest landing on I/O,
+   VRAM or the block itself so the native code has to leave early. */
+
+#define CHECK_BLOCKS  20000
+#define CHECK_CODE    0xD800
+
+struct bench_regs
+{
+    uint16_t af, bc, de, hl, sp, pc;
+    uint64_t clock;
+};
+
+static uint8_t bench_check_op ()
+{
+    /* STOP, HALT, EI and the unused opcodes */
+    static const uint8_t skipped[] = {
+        0x10, 0x76, 0xFB, 0xD3, 0xDB, 0xDD, 0xE3, 0xE4, 0xEB, 0xEC, 0xED, 0xF4, 0xFC, 0xFD
+    };
+    uint8_t op, i;
+
+    do {
+        op = rand() & 0xFF;
+        for (i = 0; i < sizeof(skipped) && skipped[i] != op; i++);
+    }
+    while (i < sizeof(skipped));
+
+    return op;
+}
+
+static uint8_t bench_check_length (const uint8_t op)
+{
+    if ((op & 0xCF) == 0x01 || (op & 0xE7) == 0xC2 || (op & 0xE7) == 0xC4 ||
+        op == 0x08 || op == 0xC3 || op == 0xCD || op == 0xEA || op == 0xFA)
+        return 3;
+    if ((op & 0xC7) == 0x06 || (op & 0xC7) == 0xC6 || (op & 0xE7) == 0x20 ||
+        op == 0x18 || op == 0xCB || op == 0xE0 || op == 0xF0 || op == 0xE8 || op == 0xF8)
+        return 2;
+    return 1;
+}
+
+static uint8_t bench_check_page ()
+{
+    return (rand() & 7) ? 0xC0 + (rand() & 0x1F) : rand() & 0xFF;
+}
+
+/* Step like gb_step, without interrupts or events, until the block ends */
+
+static void bench_check_run (struct GB * gb, const struct gb_block * b,
+    const uint8_t native, struct bench_regs * regs)
+{
+    do {
+        gb->rt = 0;
+        gb->rm = 0;
+        if (!native || !gb_jit_exec (gb))
+            gb_exec_next (gb);
+        gb->clock_t += gb->rt;
+    }
+    while (gb->block == b && gb->pc == gb->blockPC && gb->blockIdx < b->count);
+#ifdef USE_LAZY_FLAGS
+    gb_flags_sync (gb);
+#endif
+    memset (regs, 0, sizeof(struct bench_regs));
+    regs->af = (REG_A << 8) | (R_FLAGS & 0xF0);
+    regs->bc = REG_BC;
+    regs->de = REG_DE;
+    regs->hl = REG_HL;
+    regs->sp = gb->sp;
+    regs->pc = gb->pc;
+    regs->clock = gb->clock_t;
+}
+
+static void bench_check_print (const char * name, const struct bench_regs * regs, const uint64_t clock)
+{
+    printf("    %s: AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X T=%lu\n", name,
+        regs->af, regs->bc, regs->de, regs->hl, regs->sp, regs->pc,
+        (unsigned long)(regs->clock - clock));
+}
+
+static int bench_jit_check (struct GB * gb)
+{
+    static struct GB start, saved;
+    static uint8_t ram[WRAM_SIZE];
+    struct gb_block * const b = &gb->blocks[CHECK_CODE & (BLOCK_CACHE_SIZE - 1)];
+    const size_t cartSize = gb->cart.ramData ? gb->cart.ramSizeKB * 1024 : 0;
+    uint8_t * const cartRAM = malloc (cartSize + 1);
+    uint32_t n, nativeRuns = 0, mismatches = 0;
+    uint8_t i;
+
+    for (n = 0; n < 60; n++)
+        gb_frame (gb);
+
+    /* Nothing is scheduled, so native code can always run */
+    gb->ime = 0;
+    gb->nextEvent = EVENT_NEVER;
+    gb->block = NULL;
+#ifdef USE_LAZY_FLAGS
+    gb_flags_sync (gb);
+#endif
+    memcpy (&saved, gb, sizeof(struct GB));
+    memcpy (cartRAM, gb->cart.ramData, cartSize);
+    srand (1);
+
+    for (n = 0; n < CHECK_BLOCKS; n++)
+    {
+        struct bench_regs native, interp;
+        uint16_t pc = CHECK_CODE - 0xC000;
+
+        memcpy (gb, &saved, sizeof(struct GB));
+        while (pc < CHECK_CODE - 0xC000 + BLOCK_OPS_MAX * 3)
+        {
+            const uint8_t op = bench_check_op();
+            const uint8_t length = bench_check_length (op);
+
+            gb->ram[pc++] = op;
+            if (length > 1)
+                gb->ram[pc++] = rand() & 0xFF;
+            if (length > 2)
+                gb->ram[pc++] = bench_check_page();
+        }
+        REG_A   = rand() & 0xFF;
+        R_FLAGS = rand() & 0xF0;
+        REG_BC  = (bench_check_page() << 8) | (rand() & 0xFF);
+        REG_DE  = (bench_check_page() << 8) | (rand() & 0xFF);
+        REG_HL  = (bench_check_page() << 8) | (rand() & 0xFF);
+        gb->sp  = 0xDF00 | (rand() & 0xFE);
+        gb->pc  = CHECK_CODE;
+        memcpy (&start, gb, sizeof(struct GB));
+
+        /* Natively, once the block is hot */
+        for (i = 1; i < JIT_HOT_COUNT; i++)
+        {
+            gb_jit_exec (gb);
+            gb->block = NULL;
+        }
+        bench_check_run (gb, b, 1, &native);
+        nativeRuns += (b->native != NULL);
+        memcpy (ram, gb->ram, WRAM_SIZE);
+
+        /* Interpreted only */
+        memcpy (gb, &start, sizeof(struct GB));
+        memcpy (gb->cart.ramData, cartRAM, cartSize);
+        bench_check_run (gb, b, 0, &interp);
+        memcpy (gb->cart.ramData, cartRAM, cartSize);
+
+        if (memcmp (&native, &interp, sizeof(native)) || memcmp (ram, gb->ram, WRAM_SIZE))
+        {
+            if (++mismatches <= 10)
+            {
+                printf("Mismatch in block %lu:", (unsigned long)n);
+                for (i = 0; i < b->count; i++)
+                    printf(" %02X", b->ops[i].bytes[0]);
+                printf("\n");
+                bench_check_print ("native", &native, start.clock_t);
+                bench_check_print ("interp", &interp, start.clock_t);
+            }
+        }
+    }
+    memcpy (gb, &saved, sizeof(struct GB));
+    free (cartRAM);
+
+    printf("JIT check: %lu blocks, %lu run natively, %lu mismatches\n",
+        (unsigned long)CHECK_BLOCKS, (unsigned long)nativeRuns, (unsigned long)mismatches);
+
+    return mismatches != 0;
+}
+#endif
+
+#ifdef USE_OP_PROFILE
+
+/* Count opcode sequences over a set of ROMs, and write the most
+   frequent fusable pairs as the fused opcode table */
+
+#define PROFILE_PAIRS    24
+#define PROFILE_TRIPLES  8
+
+static int bench_profile (int argc, char **argv)
+{
+    FILE * out;
+    int i;
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "%s [output header] [ROM filename]...\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 2; i < argc; i++)
+    {
+        struct GB gb;
+        uint_fast32_t frames = 0;
+
+        gb.extData.ptr = &gbData;
+        gb.draw_line = app_draw_line;
+        gb.frame_ready = NULL;
+
+        if (app_load(&gb, argv[i]) == NULL)
+            return 1;
+
+        printf("Profiling \"%s\"\n", argv[i]);
+        gb_profile_break();
+        do {
+            gb_frame(&gb);
+        }
+        while(++frames < frames_per_run / 8);
+#ifdef USE_JIT
+        gb_jit_free(&gb);
+#endif
+
+        rom_file_close (gb.cart.romData);
+        free (gb.cart.ramData);
+    }
+
+    if (!(out = fopen(argv[1], "wb")))
+    {
+        fprintf(stderr, "Failed to open \"%s\"\n", argv[1]);
+        return 1;
+    }
+    gb_profile_write(out, PROFILE_PAIRS, PROFILE_TRIPLES);
+    fclose(out);
+
+    printf("Wrote \"%s\"\n", argv[1]);
+    return 0;
+}
+#endif
+
 int main (int argc, char **argv)
 {
 	char * fileName = NULL;
+    uint8_t opsOnly = 0, frameOutput = 0, jitCheck = 0;
+
+#ifdef USE_OP_PROFILE
+    return bench_profile (argc, argv);
+#endif
 
 	switch(argc)
 	{
+		case 3:
+            opsOnly = !strcmp(argv[2], "--ops");
+            frameOutput = !strcmp(argv[2], "--frames");
+#ifdef USE_JIT
+            jitCheck = !strcmp(argv[2], "--jit-check");
+#endif
+            if (!opsOnly && !frameOutput && !jitCheck)
+                goto usage;
+            /* Fall through */
 		case 2:
 			fileName = argv[1];
 			break;
 
 		default:
-			fprintf(stderr, "%s [ROM filename]\n", argv[0]);
+        usage:
+#ifdef USE_JIT
+			fprintf(stderr, "%s [ROM filename] [--ops | --frames | --jit-check]\n", argv[0]);
+#else
+			fprintf(stderr, "%s [ROM filename] [--ops | --frames]\n", argv[0]);
+#endif
 			return 1;
 	}
 
     #define RUN_TOTAL 5
+
+#ifdef USE_COMPUTED_GOTO
+    printf("Opcode dispatch: computed goto\n");
+#else
+    printf("Opcode dispatch: switch\n");
+#endif
+#ifdef USE_BLOCK_CACHE
+    printf("Block cache: on\n");
+#endif
+#ifdef USE_JIT
+    printf("JIT: on\n");
+#endif
+#ifdef USE_IDLE_SKIP
+    printf("Idle loop skipping: on\n");
+#endif
+#ifdef USE_LAZY_FLAGS
+    printf("Lazy flags: on\n");
+#endif
+#ifdef USE_OP_FUSION
+    printf("Opcode fusion: on\n");
+#endif
+#ifdef USE_RENDER_THREAD
+    printf("Render thread: on\n");
+#endif
+    if (frameOutput)
+        printf("Frame output: on\n");
+    bench_layout_report();
+
+    if (opsOnly || jitCheck)
+    {
+        /* Time single opcodes, or check the JIT, instead of whole frames */
+        struct GB gb;
+        gb.extData.ptr = &gbData;
+        gb.draw_line = app_draw_line;
+        gb.frame_ready = NULL;
+
+        if (app_load(&gb, fileName) == NULL)
+            return 1;
+
+#ifdef USE_JIT
+        if (jitCheck)
+        {
+            const int failed = bench_jit_check (&gb);
+            gb_jit_free (&gb);
+            rom_file_close (gb.cart.romData);
+            free (gb.cart.ramData);
+            return failed;
+        }
+#endif
+        bench_opcodes (&gb);
+        bench_steps (&gb);
+        bench_lines (&gb);
+#ifdef USE_JIT
+        gb_jit_free (&gb);
+#endif
+        rom_file_close (gb.cart.romData);
+        free (gb.cart.ramData);
+        return 0;
+    }
     float fpsTotal = 0;
     float durationTotal = 0;
 
@@ -143,27 +654,38 @@ int main (int argc, char **argv)
 		struct GB gb;
         gb.extData.ptr = &gbData;
 
-		clock_t start_time;
+		double start_time;
 		uint_fast32_t frames = 0;
 
         /* Assign functions to be used by emulator */
         gb.draw_line = app_draw_line;
-        gb.cart.rom_read = app_cart_rom_read;
+        gb.frame_ready = NULL;
+        if (frameOutput)
+            app_frame_output (&gb);
 
         if (app_load(&gb, fileName) == NULL)
             return 1;
+#ifdef USE_RENDER_THREAD
+        gb_render_start(&gb);
+#endif
 
 		printf("Run %u: ", i);
-		start_time = clock();
+		start_time = bench_time();
 
 		do {
 			gb_frame(&gb);
 		}
 		while(++frames < frames_per_run);
+#ifdef USE_RENDER_THREAD
+        gb_render_stop(&gb);
+#endif
+#ifdef USE_JIT
+        gb_jit_free(&gb);
+#endif
 
 		{
 			double duration =
-				(double)(clock() - start_time) / CLOCKS_PER_SEC;
+				bench_time() - start_time;
 			double fps = frames / duration;
 			printf("Ran %ld frames, %f FPS, duration: %f\n",
                 (long int)frames_per_run, fps, duration);
@@ -172,7 +694,7 @@ int main (int argc, char **argv)
             durationTotal += duration;
 		}
 
-        free (gb.cart.romData);
+        rom_file_close (gb.cart.romData);
         free (gb.cart.ramData);
 	}
 
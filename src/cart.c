@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include "cart.h"
 
 #define LOW_BANK       (addr <= 0x3FFF)
@@ -12,7 +13,134 @@
 #define BANK_SELECT_H  (addr >= 0x3000 && addr <= 0x3FFF)
 #define MODE_SELECT    (addr >= 0x6000 && addr <= 0x7FFF)
 
-#define RAM_ADDR       (cart->ramBank * 0x2000) + (addr - 0xA000)
+#define RAM_BANK_SIZE  0x2000
+
+#define RTC_CLOCK      4194304 /* Clock counts per second, as CPU cycles */
+#define RTC_DAY        (86400ULL * RTC_CLOCK)
+#define RTC_REG        (cart->ramBank >= 0x8 && cart->ramBank <= 0xC)
+
+/* ROM reads go through the bank pointers, chosen by the address's bank area */
+#define ROM_READ       ((addr & 0x4000) ? cart->bankNPtr : cart->bank0Ptr)[addr & 0x3FFF]
+
+/* Store to the selected RAM bank, and mark the block for saving */
+
+static inline void cart_ram_write(struct Cartridge *cart, const uint16_t offset, const uint8_t val)
+{
+    cart->ramBankPtr[offset] = val;
+    if (cart->trackRAM)
+    {
+        const uint32_t block = (cart->ramBankPtr - cart->ramData + offset) / RAM_DIRTY_BLOCK;
+        cart->ramDirty[block >> 3] |= 1 << (block & 7);
+    }
+}
+
+/* The time the MBC3 clock counts from, as emulated cycles by default or
+   as host time when USE_RTC_HOST_TIME is defined */
+
+static inline uint64_t cart_rtc_now(const struct Cartridge *cart)
+{
+#ifdef USE_RTC_HOST_TIME
+    return (uint64_t)time(NULL) * RTC_CLOCK;
+#else
+    return cart->clock ? *cart->clock : 0;
+#endif
+}
+
+static void cart_rtc_set(struct Cartridge *cart, const uint64_t count)
+{
+    cart->rtcCount = count;
+    cart->rtcBase  = cart_rtc_now(cart) - count;
+}
+
+/* Get the clock count, wrapping the 9-bit day counter into the carry */
+
+static uint64_t cart_rtc_count(struct Cartridge *cart)
+{
+    const uint64_t count = cart->rtcHalt ?
+        cart->rtcCount : cart_rtc_now(cart) - cart->rtcBase;
+
+    if (count < 512 * RTC_DAY)
+        return count;
+
+    cart->rtcCarry = 1;
+    cart_rtc_set(cart, count % (512 * RTC_DAY));
+    return cart->rtcCount;
+}
+
+static void cart_rtc_latch(struct Cartridge *cart)
+{
+    const uint64_t secs = cart_rtc_count(cart) / RTC_CLOCK;
+    const uint16_t days = secs / 86400;
+
+    cart->rtcRegs[0] = secs % 60;
+    cart->rtcRegs[1] = secs / 60 % 60;
+    cart->rtcRegs[2] = secs / 3600 % 24;
+    cart->rtcRegs[3] = days & 0xFF;
+    cart->rtcRegs[4] = (days >> 8) | (cart->rtcHalt << 6) | (cart->rtcCarry << 7);
+}
+
+/* Set one clock register. The count is rebuilt from all of them, so
+   out of range values are carried over instead of kept as written */
+
+static void cart_rtc_write(struct Cartridge *cart, const uint8_t reg, const uint8_t val)
+{
+    uint64_t count = cart_rtc_count(cart);
+    uint64_t sub = count % RTC_CLOCK;
+    uint64_t secs = count / RTC_CLOCK;
+    uint32_t
+        s = secs % 60,
+        m = secs / 60 % 60,
+        h = secs / 3600 % 24,
+        d = secs / 86400;
+
+    switch (reg)
+    {
+        case 0: s = val & 0x3F; sub = 0; break; /* Also resets the divider */
+        case 1: m = val & 0x3F; break;
+        case 2: h = val & 0x1F; break;
+        case 3: d = (d & 0x100) | val; break;
+        case 4:
+            d = (d & 0xFF) | ((val & 1) << 8);
+            cart->rtcHalt  = (val >> 6) & 1;
+            cart->rtcCarry = (val >> 7);
+            break;
+    }
+    count = ((uint64_t)d * 86400 + h * 3600 + m * 60 + s) * RTC_CLOCK + sub;
+    cart_rtc_set(cart, count);
+    cart->rtcRegs[reg] = val;
+}
+
+/* ROM banks selected by the MBC registers, for the lower and upper areas */
+
+static inline uint8_t mbc1_rom_bank(const struct Cartridge *cart, const uint16_t addr)
+{
+    if LOW_BANK /* User upper 2 bank bits in mode 1 */
+        return (cart->mode == 1) ? ((cart->romBank2 << 5) & cart->romMask) : 0;
+
+    const uint8_t bank = (cart->romBank1 == 0) ? 1 : cart->romBank1;
+    return ((cart->romBank2 << 5) + bank) & cart->romMask;
+}
+
+static inline uint8_t mbc2_rom_bank(const struct Cartridge *cart, const uint16_t addr)
+{
+    if LOW_BANK
+        return 0;
+    return (cart->romBank1 == 0 ? 1 : cart->romBank1) & cart->romMask;
+}
+
+static inline uint8_t mbc3_rom_bank(const struct Cartridge *cart, const uint16_t addr)
+{
+    if LOW_BANK
+        return 0;
+    return cart->romBank1 & cart->romMask; /* Also used for HuC1 */
+}
+
+static inline uint16_t mbc5_rom_bank(const struct Cartridge *cart, const uint16_t addr)
+{
+    if LOW_BANK
+        return 0;
+    return ((cart->romBank2 << 8) + cart->romBank1) & cart->romMask; /* Combine 9th bit with lower 8 bits */
+}
 
 /* Read/write implementations for different MBCs */
 
@@ -20,7 +148,7 @@ uint8_t none_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
 {
     if (!write) /* Read from cartridge */
         if (addr <= 0x7FFF)
-            return cart->rom_read(cart, addr);
+            return ROM_READ;
     /* Nothing to write here */
     return 0xFF;
 }
@@ -29,25 +157,13 @@ uint8_t mbc1_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
 {
     if (!write) /* Read from cartridge */
     {
-        if LOW_BANK
-        { /* User upper 2 bank bits in mode 1 */
-            const uint8_t selectedBank = (cart->romBank2 << 5) & cart->romMask;
-            return cart->rom_read(cart, addr + ((cart->mode == 1) ? (selectedBank * ROM_BANK_SIZE) : 0));
-        }
-        if HIGH_BANK
-        {
-            const uint8_t bank = (cart->romBank1 == 0) ? 1 : cart->romBank1;
-            const uint8_t selectedBank = ((cart->romBank2 << 5) + bank) & cart->romMask;
-            return cart->rom_read(cart, (selectedBank - 1) * ROM_BANK_SIZE + addr);
-        }
+        if (LOW_BANK || HIGH_BANK)
+            return ROM_READ;
         if (RAM_BANK && cart->ram)
-        { /* Select RAM bank and fetch data (if enabled) */
+        { /* Fetch data from the selected RAM bank (if enabled) */
             if (!cart->usingRAM)
                 return 0xFF;
-            if (cart->ramSizeKB == 8)
-                return cart->ramData[addr & 0x1FFF]; /* Fetch only lower 8KB     */
-            const uint16_t ramOffset = (cart->mode == 1) ? (cart->romBank2 * 0x2000) : 0;
-            return cart->ramData[(addr & 0x1FFF) + ramOffset];
+            return cart->ramBankPtr[addr & 0x1FFF];
         }
         return 0xFF;
     }
@@ -61,17 +177,13 @@ uint8_t mbc1_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
             cart->romBank2 = (val & 3); /* Write upper 2 bank bits  */
         if MODE_SELECT
             cart->mode = (val & 1); /* Simple/RAM banking mode  */
+        if (addr <= 0x7FFF)
+            cart_map_banks(cart);
         if (RAM_BANK && cart->ram)
         { /* Write to RAM if enabled  */
             if (!cart->usingRAM)
-                return 0; /* Write only to lower 8KB if mode 0 or smaller bank  */
-            if (cart->ramSizeKB == 8)
-            {
-                cart->ramData[addr & 0x1FFF] = val;
                 return 0;
-            }
-            const uint16_t ramOffset = (cart->mode == 1) ? (cart->romBank2 * 0x2000) : 0;
-            cart->ramData[(addr & 0x1FFF) + ramOffset] = val;
+            cart_ram_write(cart, addr & 0x1FFF, val);
         }
     }
     return 0;
@@ -81,18 +193,13 @@ uint8_t mbc2_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
 {
     if (!write) /* Read from cartridge */
     {
-        if LOW_BANK
-            return cart->rom_read(cart, addr);
-        if HIGH_BANK
-        {
-            const uint8_t selectedBank = (cart->romBank1 == 0 ? 1 : cart->romBank1) & cart->romMask;
-            return cart->rom_read(cart, (selectedBank - 1) * ROM_BANK_SIZE + addr);
-        }
+        if (LOW_BANK || HIGH_BANK)
+            return ROM_READ;
         if RAM_BANK
         {
             if (!cart->usingRAM)
                 return 0;
-            return cart->ramData[addr & 0x1FF] & 0xF; /* Return only lower 4 bits  */
+            return cart->ramBankPtr[addr & 0x1FF] & 0xF; /* Return only lower 4 bits  */
         }
     }
     else /* Write to registers */
@@ -101,7 +208,10 @@ uint8_t mbc2_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
         {
             const uint8_t setRomBank = (addr >> 8) & 1;
             if (setRomBank)
+            {
                 cart->romBank1 = val & 0xF; /* LSB == 1, ROM bank select */
+                cart_map_banks(cart);
+            }
             else
                 cart->usingRAM = ((val & 0xF) == 0xA); /* LSB == 0, RAM switch      */
         }
@@ -109,7 +219,7 @@ uint8_t mbc2_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
         {
             if (!cart->usingRAM)
                 return 0xFF;
-            cart->ramData[addr & 0x1FFF] = (val & 0xF) | 0xF0; /* Write only lower 4 bits   */
+            cart_ram_write(cart, addr & 0x1FF, (val & 0xF) | 0xF0); /* Write only lower 4 bits   */
         }
     }
     return 0;
@@ -119,16 +229,14 @@ uint8_t mbc3_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
 {
     if (!write) /* Read from cartridge */
     {
-        if LOW_BANK
-            return cart->rom_read(cart, addr);
-        if HIGH_BANK
-            return cart->rom_read(cart, ((cart->romBank1 & cart->romMask) - 1) * ROM_BANK_SIZE + addr);
+        if (LOW_BANK || HIGH_BANK)
+            return ROM_READ;
+        if (RAM_BANK && cart->rtc && RTC_REG)
+            return cart->usingRAM ? cart->rtcRegs[cart->ramBank - 8] : 0xFF;
         if (RAM_BANK && cart->ram)
-        { /* Select RAM bank and fetch data (if enabled) */
-            if (cart->ramSizeKB == 8)
-                return cart->ramData[addr & 0x1FFF]; /* Fetch only lower 8KB     */
-            if (cart->ramBank < 4)
-                return cart->ramData[RAM_ADDR];
+        { /* Fetch data from the selected RAM bank (if mapped) */
+            if (cart->ramBankPtr)
+                return cart->ramBankPtr[addr & 0x1FFF];
             else
                 return 0xFF;
         }
@@ -141,12 +249,26 @@ uint8_t mbc3_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
             cart->romBank1 = ((val == 0) ? 1 : (val & 0x7F)); /* Write lower 7 bank bits  */
         if BANK_SELECT_2
             cart->ramBank = val;                              /* Lower 2 bits for RAM     */
+        if (MODE_SELECT && cart->rtc)
+        {                                                     /* Latch clock on 0 then 1  */
+            if (cart->rtcLatch == 0 && val == 1)
+                cart_rtc_latch(cart);
+            cart->rtcLatch = val;
+        }
+        if (addr <= 0x7FFF)
+            cart_map_banks(cart);
+        if (RAM_BANK && cart->rtc && RTC_REG)
+        {
+            if (cart->usingRAM)
+                cart_rtc_write(cart, cart->ramBank - 8, val);
+            return 0xFF;
+        }
         if (RAM_BANK && cart->ram)
         {                                  /* Select RAM bank and fetch data (if enabled) */
             if (!cart->usingRAM)
                 return 0xFF;                     /* Write only to lower 8KB if no banking */
-            if (cart->ramBank < 4)
-                cart->ramData[RAM_ADDR] = val;
+            if (cart->ramBankPtr)
+                cart_ram_write(cart, addr & 0x1FFF, val);
         }
     }
     return 0xFF;
@@ -156,21 +278,12 @@ uint8_t mbc5_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
 {
     if (!write) /* Read from cartridge */
     {
-        const uint16_t selectedBank = /* Combine 9th bit with lower 8 bits */
-            (((cart->romBank2 << 8) + cart->romBank1) & cart->romMask);
-
-        if LOW_BANK
-            return cart->rom_read(cart, addr);
-        if HIGH_BANK
-        {
-            return cart->rom_read(cart, (selectedBank - 1) * ROM_BANK_SIZE + addr);
-        }
+        if (LOW_BANK || HIGH_BANK)
+            return ROM_READ;
         if (RAM_BANK && cart->ram)
-        { /* Select RAM bank and fetch data (if enabled) */
-            if (cart->ramSizeKB == 8)
-                return cart->ramData[addr & 0x1FFF]; /* Fetch only lower 8KB     */
-            if (cart->ramBank < 16)
-                return cart->ramData[RAM_ADDR];
+        { /* Fetch data from the selected RAM bank (if mapped) */
+            if (cart->ramBankPtr)
+                return cart->ramBankPtr[addr & 0x1FFF];
             else
                 return 0xFF;
         }
@@ -185,12 +298,14 @@ uint8_t mbc5_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
             cart->romBank2 = val & 1;
         if BANK_SELECT_2                                      /* Lower 4 bits for RAM     */
             cart->ramBank = val;
+        if (addr <= 0x7FFF)
+            cart_map_banks(cart);
         if (RAM_BANK && cart->ram)
         {                                  /* Select RAM bank and fetch data (if enabled) */
             if (!cart->usingRAM)
                 return 0xFF;                     /* Write only to lower 8KB if no banking */
-            if (cart->ramBank < 16)
-                cart->ramData[RAM_ADDR] = val;
+            if (cart->ramBankPtr)
+                cart_ram_write(cart, addr & 0x1FFF, val);
         }
     }
     return 0xFF;
@@ -200,15 +315,13 @@ uint8_t huc1_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
 {
     if (!write) /* Read from cartridge */
     {
-        if LOW_BANK
-            return cart->rom_read(cart, addr);
-        if HIGH_BANK
-            return cart->rom_read(cart, ((cart->romBank1 & cart->romMask) - 1) * ROM_BANK_SIZE + addr);
+        if (LOW_BANK || HIGH_BANK)
+            return ROM_READ;
         if RAM_BANK
         {
-            if (!cart->usingRAM)
+            if (!cart->usingRAM || !cart->ramBankPtr)
                 return 0xFF;
-            return cart->ramData[RAM_ADDR];
+            return cart->ramBankPtr[addr & 0x1FFF];
         }
     }  
     else /* Write to registers */
@@ -222,11 +335,13 @@ uint8_t huc1_rw(struct Cartridge *cart, const uint16_t addr, const uint8_t val,
         }
         if BANK_SELECT_2
             cart->ramBank = val;
+        if (addr <= 0x7FFF)
+            cart_map_banks(cart);
         if RAM_BANK
         {
-            if (!cart->usingRAM)
+            if (!cart->usingRAM || !cart->ramBankPtr)
                 return 0xFF;
-            cart->ramData[RAM_ADDR] = val;
+            cart_ram_write(cart, addr & 0x1FFF, val);
         }
     }
     return 0xFF;
@@ -239,6 +354,138 @@ uint8_t (*cart_rw[])(struct Cartridge *, const uint16_t, const uint8_t, const ui
     none_rw, mbc1_rw, mbc2_rw, mbc3_rw, NULL, mbc5_rw, NULL, NULL, huc1_rw
 };
 
+/* Get the ROM bank mapped to the area of the address (0000-3FFF or 4000-7FFF) */
+
+uint16_t cart_rom_bank(const struct Cartridge *cart, const uint16_t addr)
+{
+    switch (cart->mbc)
+    {
+        case 1:  return mbc1_rom_bank(cart, addr);
+        case 2:  return mbc2_rom_bank(cart, addr);
+        case 3:
+        case 8:  return mbc3_rom_bank(cart, addr);
+        case 5:  return mbc5_rom_bank(cart, addr);
+        default: return LOW_BANK ? 0 : 1;
+    }
+}
+
+/* Get the RAM bank mapped to A000-BFFF, or -1 if none is mapped */
+
+static int cart_ram_bank(const struct Cartridge *cart)
+{
+    switch (cart->mbc)
+    {
+        case 1: /* Upper 2 bank bits select RAM in mode 1 */
+            return (cart->mode == 1 && cart->ramSizeKB > 8) ? cart->romBank2 : 0;
+        case 3:
+            if (cart->ramBank >= 4) return -1; /* RTC registers */
+            return (cart->ramSizeKB > 8) ? cart->ramBank : 0;
+        case 5:
+            if (cart->ramBank >= 16) return -1;
+            return (cart->ramSizeKB > 8) ? cart->ramBank : 0;
+        case 8:
+            return cart->ramBank;
+        default:
+            return 0;
+    }
+}
+
+/* Point to the ROM and RAM banks selected by the MBC registers. Called
+   when the registers change, so reads don't need to look up the banks */
+
+void cart_map_banks(struct Cartridge *cart)
+{
+    cart->bank0Ptr = cart->romData + cart_rom_bank(cart, 0)      * ROM_BANK_SIZE;
+    cart->bankNPtr = cart->romData + cart_rom_bank(cart, 0x4000) * ROM_BANK_SIZE;
+
+    const int ramBank = cart_ram_bank(cart);
+    if (!cart->ramData || ramBank < 0 || ramBank * RAM_BANK_SIZE >= cart->ramSizeKB * 1024)
+        cart->ramBankPtr = NULL;
+    else
+        cart->ramBankPtr = cart->ramData + ramBank * RAM_BANK_SIZE;
+
+    /* Plain RAM that follows the enable register is mapped directly.
+       MBC2 RAM is only 4 bits wide, and MBC3 can read it while disabled */
+    cart->ramReadPtr = cart->ramWritePtr = NULL;
+    switch (cart->mbc)
+    {
+        case 1:
+        case 8:
+            if (cart->usingRAM)
+                cart->ramReadPtr = cart->ramWritePtr = cart->ramBankPtr;
+            break;
+        case 3:
+        case 5:
+            cart->ramReadPtr = cart->ramBankPtr;
+            if (cart->usingRAM)
+                cart->ramWritePtr = cart->ramBankPtr;
+            break;
+    }
+}
+
+/* Clock state in the save file, in the 48-byte format most emulators
+   use: the clock and latched registers as 32-bit little-endian values,
+   then the 64-bit UNIX time it was saved at */
+
+static uint64_t cart_rtc_get_le(const uint8_t *p, const uint8_t bytes)
+{
+    uint64_t val = 0;
+    uint8_t i;
+    for (i = bytes; i > 0; i--)
+        val = (val << 8) | p[i - 1];
+    return val;
+}
+
+static void cart_rtc_put_le(uint8_t *p, uint64_t val, const uint8_t bytes)
+{
+    uint8_t i;
+    for (i = 0; i < bytes; i++, val >>= 8)
+        p[i] = val & 0xFF;
+}
+
+void cart_rtc_load(struct Cartridge *cart, const uint8_t *save)
+{
+    uint8_t regs[5];
+    uint8_t i;
+    for (i = 0; i < 5; i++)
+    {
+        regs[i] = cart_rtc_get_le(save + i * 4, 4);
+        cart->rtcRegs[i] = cart_rtc_get_le(save + 20 + i * 4, 4);
+    }
+    cart->rtcHalt  = (regs[4] >> 6) & 1;
+    cart->rtcCarry = (regs[4] >> 7);
+
+    uint64_t secs = ((uint64_t)((regs[4] & 1) << 8 | regs[3]) * 86400) +
+        regs[2] * 3600 + regs[1] * 60 + regs[0];
+#ifdef USE_RTC_HOST_TIME
+    /* Count the time spent switched off */
+    const uint64_t saved = cart_rtc_get_le(save + 40, 8);
+    const uint64_t now = time(NULL);
+    if (!cart->rtcHalt && saved && saved <= now)
+        secs += now - saved;
+#endif
+    cart_rtc_set(cart, secs * RTC_CLOCK);
+    cart_rtc_count(cart);
+}
+
+void cart_rtc_save(struct Cartridge *cart, uint8_t *save)
+{
+    const uint8_t latched[5] = {
+        cart->rtcRegs[0], cart->rtcRegs[1], cart->rtcRegs[2],
+        cart->rtcRegs[3], cart->rtcRegs[4]
+    };
+    uint8_t i;
+
+    cart_rtc_latch(cart);
+    for (i = 0; i < 5; i++)
+    {
+        cart_rtc_put_le(save + i * 4, cart->rtcRegs[i], 4);
+        cart_rtc_put_le(save + 20 + i * 4, latched[i], 4);
+    }
+    cart_rtc_put_le(save + 40, time(NULL), 8);
+    memcpy(cart->rtcRegs, latched, sizeof(latched));
+}
+
 /* Array to select whether or not the cart has a battery */
 
 const uint8_t cartBattery[0x100] =
@@ -271,7 +518,7 @@ void cart_identify(struct Cartridge *cart)
     LOG_("GB: Checksum 2: $%02X\n", cart->checksum);
 
     /* Get cartridge type and MBC from header */
-    memcpy(cart->header, cart->romData + 0x100, 80 * sizeof(uint8_t));
+    cart->header = cart->romData + 0x100;
     const uint8_t *header = cart->header;
 
     const uint8_t cartType = header[0x47];
@@ -319,7 +566,13 @@ void cart_identify(struct Cartridge *cart)
     cart->ramSizeKB = (cart->mbc == 2) ? 1 : ramBanks[header[0x49]];
     cart->ram = (cart->ramSizeKB > 0);
     cart->battery = cartBattery[cartType];
-    cart->romMask = (1 << (header[0x48] + 1)) - 1;
+    cart->rtc = (cartType == 0xF || cartType == 0x10);
+    cart->romMask = (1 << ((header[0x48] > 8 ? 8 : header[0x48]) + 1)) - 1;
+
+    /* Banks past the end of the image are never selected */
+    if (cart->romSize)
+        while (cart->romMask && (cart->romMask + 1UL) * ROM_BANK_SIZE > cart->romSize)
+            cart->romMask >>= 1;
 
     LOG_("GB: RAM file size (KiB): %d\n", cart->ramSizeKB);
     LOG_("GB: Cart type: %02X Mapper type: %d\n", header[0x47], cart->mbc);
@@ -331,9 +584,14 @@ void cart_identify(struct Cartridge *cart)
         cart->ramData = calloc(cart->ramSizeKB * 1024, sizeof(uint8_t));
     }
 
+    cart->trackRAM = 0;
+    cart->rtcHalt  = cart->rtcCarry = cart->rtcLatch = 0;
+    memset(cart->rtcRegs, 0, sizeof(cart->rtcRegs));
+    cart_rtc_set(cart, 0);
     cart->usingRAM = 0;
     cart->romBank1 = (cart->mbc == 5) ? 1 : 0;
     cart->romBank2 = 0;
     cart->ramBank = 0;
     cart->mode = 0;
+    cart_map_banks(cart);
 }
\ No newline at end of file
@@ -14,17 +14,21 @@
 
 #define GB_HEADER_SIZE   0x50
 #define ROM_BANK_SIZE    0x4000
+#define CART_RAM_MAX     0x20000 /* 128 KiB, the largest RAM size       */
+#define RAM_DIRTY_BLOCK  0x100   /* RAM bytes for each bit of ramDirty,
+                                    one memory map page                 */
+#define RTC_SAVE_SIZE    48      /* Clock state saved after the RAM     */
 
 struct Cartridge 
 {
-    /* ROM and RAM that can be accessed */
+    /* ROM and RAM that can be accessed. ROM may be a shared, read-only image */
     uint8_t * romData;
     uint8_t * ramData;
-    uint8_t romData_0[ROM_BANK_SIZE];
+    uint32_t  romSize; /* Bytes in the ROM image, or 0 if not known */
 
     /* Information about the game and its hardware */
-    uint8_t  
-        header[GB_HEADER_SIZE],
+    const uint8_t * header; /* GB_HEADER_SIZE bytes at 0x100 in the ROM */
+    uint8_t
         mbc,
         cartType,
         checksum;
@@ -34,18 +38,28 @@ struct Cartridge
     uint8_t ram     : 1;
     uint8_t battery : 1;
     uint8_t rtc     : 1;
+    uint8_t trackRAM: 1; /* Mark RAM writes in ramDirty, for saving */
+
+    /* RAM blocks written since the last save, and one for the clock */
+    uint8_t ramDirty[CART_RAM_MAX / RAM_DIRTY_BLOCK / 8 + 1];
 
     /* MBC registers */
     uint8_t romBank1;  /* for most ROMS, 4 MiB and under    */
     uint8_t romBank2;  /* for additional ROM bank bits      */
     uint8_t ramBank;
 
+    /* Banks selected by the MBC registers, updated when they are written */
+    uint8_t * bank0Ptr;    /* 0000-3FFF                         */
+    uint8_t * bankNPtr;    /* 4000-7FFF                         */
+    uint8_t * ramBankPtr;  /* A000-BFFF, NULL if nothing mapped */
+
+    /* RAM bank when it can be accessed without the MBC, else NULL */
+    uint8_t * ramReadPtr;
+    uint8_t * ramWritePtr;
+
     /* Pointer to MBC read/write function */
     uint8_t (* rw)(struct Cartridge *, const uint16_t addr, const uint8_t val, const uint8_t write);
 
-    /* Functions that rely on external data */
-    uint8_t (* rom_read)(void *, const uint32_t addr);
-
     uint16_t 
         romSizeKB,
         ramSizeKB,
@@ -53,9 +67,24 @@ struct Cartridge
     uint8_t
         mode,
         usingRAM;
+
+    /* MBC3 clock. It isn't ticked: the count is the time since rtcBase,
+       or rtcCount while halted, and is only worked out when latched */
+    const uint64_t * clock; /* Emulated cycles, to measure time by   */
+    uint64_t rtcBase;
+    uint64_t rtcCount;
+    uint8_t  rtcRegs[5];    /* Latched seconds, minutes, hours, days */
+    uint8_t
+        rtcHalt,
+        rtcCarry,
+        rtcLatch;
 };
 
-void cart_identify (struct Cartridge *);
+void     cart_identify (struct Cartridge *);
+uint16_t cart_rom_bank (const struct Cartridge *, const uint16_t addr);
+void     cart_map_banks(struct Cartridge *);
+void     cart_rtc_load (struct Cartridge *, const uint8_t * save);
+void     cart_rtc_save (struct Cartridge *, uint8_t * save);
 
 /* Concrete MBC read/write functions */
 
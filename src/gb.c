@@ -4,125 +4,313 @@
 #include <assert.h>
 #include "gb.h"
 #include "ops.h"
+#ifdef USE_JIT
+#include "jit.h"
+#endif
+#ifdef USE_RENDER_THREAD
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
 
-#if defined(ASSERT_INSTR_TIMING) || !defined(USE_INC_MCYCLE)
+#if defined(ASSERT_INSTR_TIMING) || !defined(USE_INC_MCYCLE) || defined(USE_BLOCK_CACHE)
 #include "opcycles.h"
 #endif
 
+/* Lines are composited with SSE2 where the compiler targets it, and
+   with SSSE3 shuffles if enabled. Define NO_SIMD to use plain C */
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#define PPU_SIMD
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#endif
+
 #define _FORCE_INLINE __attribute__((always_inline)) inline
 
 /*
  **********  Memory/bus read and write  ************
  */
-#define RISING_EDGE(before, after)  ((before & 1) < (after & 1))
-#define FALLING_EDGE(before, after) ((before & 1) > (after & 1))
+#ifdef USE_BLOCK_CACHE
+static void gb_code_invalidate (struct GB *, const uint16_t);
+static void gb_code_protect    (struct GB *);
+
+/* Writes to RAM holding cached code invalidate blocks on that page */
+#define CODE_WRITE(gb, i)\
+    if (gb->codeMap[(i) >> 3] & (1 << ((i) & 7)))\
+        gb_code_invalidate (gb, i)
+#else
+#define CODE_WRITE(gb, i)
+#endif
+
+static void gb_timer_schedule (struct GB *);
+static void gb_ppu_next (struct GB *);
+static void gb_ppu_schedule (struct GB *);
+static void gb_mem_map_pages (struct GB *);
+#ifdef ENABLE_AUDIO
+static void gb_div_apu_schedule (struct GB *, const uint64_t);
+#endif
+#ifdef USE_RENDER_THREAD
+static void gb_render_log (struct GB *, const uint16_t, const uint8_t);
+
+/* VRAM and OAM writes are passed on to the renderer's copy */
+#define RENDER_LOG(gb, addr, val)\
+    if (gb->renderer)\
+        gb_render_log (gb, addr, val)
+#else
+#define RENDER_LOG(gb, addr, val)
+#endif
+
+/* Time of the current bus access, counting m-cycles of this step so far */
+#define BUS_TIME(gb)  (gb->clock_t + (gb->rm << 2))
+
+/* Catch up the PPU before its state is accessed, if it changed since */
+#define PPU_SYNC(gb)\
+    if (BUS_TIME (gb) >= gb->ppuNext)\
+        gb_render (gb, BUS_TIME (gb))
+
+/* I/O registers FF00-FF7F and IE. Reads run the register's sync, if any,
+   and return it with the unused bits set. Writes go to the register's
+   handler, or are stored with the bits that can't be cleared */
 
-uint8_t gb_io_rw(struct GB *gb, const uint16_t addr, const uint8_t val, const uint8_t write)
+struct gb_io_reg
 {
-    const uint8_t reg = addr & 0xFF;
+    uint8_t readMask;
+    uint8_t writeMask;
+    void (* read) (struct GB *);
+    void (* write)(struct GB *, const uint8_t reg, const uint8_t val);
+};
+
+static const struct gb_io_reg ioRegs[0x100]; /* Filled in after the handlers */
+
+/* Timer registers, IF and the PPU are updated only when read */
+
+static void gb_io_timer_sync(struct GB *gb)
+{
+    gb_timer_sync(gb, BUS_TIME(gb));
+}
+
+static void gb_io_ppu_sync(struct GB *gb)
+{
+    PPU_SYNC (gb);
+}
+
+static void gb_io_joypad_sync(struct GB *gb)
+{
+    gb_joypad(gb, 0, 0);
+}
+
+/* Registers with side effects when written */
+
+static void gb_io_joypad_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    gb_joypad(gb, val, 1);
+}
+
+static void gb_io_serial_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    gb->io[SerialCtrl].r = val; /* Start transfer with internal clock      */
+    if ((val & 0x81) == 0x81)
+        gb_schedule(gb, EVENT_SERIAL, gb->clock_t + SERIAL_CYCLES);
+}
+
+static void gb_io_div_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    gb_timer_sync(gb, BUS_TIME(gb));
+    gb->io[Divider].r = 0;
+#ifdef ENABLE_AUDIO
+    gb_div_apu_schedule(gb, BUS_TIME(gb));
+#endif
+}
+
+static void gb_io_timer_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    gb_timer_sync(gb, BUS_TIME(gb));
+    gb->io[reg].r = val | ioRegs[reg].writeMask;
+    gb_timer_schedule(gb);
+}
+
+static void gb_io_intr_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    gb_timer_sync(gb, BUS_TIME(gb));
+    gb->io[IntrFlags].r = val | 0xE0; /* Mask unused bits for IF */
+    gb_irq_update(gb);
+}
+
+static void gb_io_ie_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    gb->io[IntrEnabled].r = val;
+    gb_irq_update(gb);
+}
 
-    if (!write)
-    {
 #ifdef ENABLE_AUDIO
-        if (reg >= NR10 && reg <= Wave + 0xF)
-            return gb_apu_rw(gb, reg, val, write);
+static void gb_io_apu_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    gb_apu_rw(gb, reg, val, 1);
+}
 #endif
-        if (reg == IntrEnabled && gb->io[reg].r == 0)
-            return gb->io[reg].r;
 
-        const uint8_t bitmask = 
-            (reg == Joypad)      ? 0xC0 :
-            (reg == SerialCtrl)  ? 0x7E :
-            (reg == IntrFlags)   ? 0xE0 :
-            (reg == LCDStatus)   ? 0x80 :
-            (reg == IntrEnabled) ? 0xE0 : 0;
+/* Lines up to now are drawn before PPU registers change */
+
+static void gb_io_ppu_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    PPU_SYNC (gb);
+    gb->io[reg].r = val;
+}
+
+static void gb_io_lcdc_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    PPU_SYNC (gb);
 
-        /* Return bitmasked value */
-        return gb->io[reg].r | bitmask;
+    /* Check whether LCD will be turned on or off */
+    const uint8_t lcdEnabled =  gb->io[LCDControl].LCD_Enable;
+    if (lcdEnabled && !(val & (1 << LCD_Enable)))
+    {
+        LOG_("GB: [ ] LCD turn off (%d:%d)\n", gb->totalFrames, gb->io[LY].r);
+        IO_STAT_MODE = 0; /* Clear STAT mode when turning off LCD       */
+        gb->io[LY].r = 0;
+    }
+    else if (!lcdEnabled && (val & (1 << LCD_Enable)))
+    {
+        LOG_("GB: [#] LCD turn on  (%d:%d)\n", gb->totalFrames, gb->io[LY].r);
+        gb->lineClock = 0; /* Start from the beginning of line 0 */
+        gb->ppuClock = BUS_TIME(gb);
     }
+    gb->io[LCDControl].r = val;
+    gb_ppu_next(gb);
+    gb_ppu_schedule(gb);
+}
+
+static void gb_io_ly_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    PPU_SYNC (gb);
+    gb->io[LY].r = val; /* Writing to LY resets line counter      */
+    gb_ppu_next(gb);
+    gb_ppu_schedule(gb);
+}
+
+static void gb_io_stat_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    PPU_SYNC (gb);  /* Mode and LY=LYC bits are read-only      */
+    gb->io[LCDStatus].r = (val & 0x78) | (gb->io[LCDStatus].r & 7);
+    gb_ppu_schedule(gb);
+}
+
+static void gb_io_lyc_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    PPU_SYNC (gb);
+    gb->io[LYC].r = val;
+    gb_ppu_schedule(gb);
+}
+
+/* OAM DMA transfer. OAM is copied at once, as only the PPU could see it
+   change and the CPU can't read it until the end. The CPU is then locked
+   out of the bus, except for high RAM, until the transfer time is up */
+
+static void gb_io_dma_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    PPU_SYNC (gb);
+    gb->io[DMA].r = val;
+
+    /* The source always lies within one page */
+    const uint8_t * page = gb->readPage[val];
+    if (page)
+        memcpy(gb->oam, page, OAM_SIZE);
     else
+    {   /* Other memory goes through the bus, but without taking CPU time */
+        const uint_fast16_t rm = gb->rm;
+        int i;
+        for (i = 0; i < OAM_SIZE; i++)
+            gb->oam[i] = gb_mem_read(gb, (val << 8) + i);
+        gb->rm = rm;
+    }
+    gb->spritesDirty = 1;
+#ifdef USE_RENDER_THREAD
+    if (gb->renderer)
     {
-        switch (reg)
-        {
-#ifdef USE_TIMER_SIMPLE
-            case Divider:
-                gb->io[Divider].r = 0;
-                break;
-            case TimA:
-                gb->io[TimA].r = val;
-                break;
-            case TMA:
-                gb->io[TMA].r = val;
-                break;
-#else
-            case Divider:
-                gb_update_timer(gb, 0);
-                break; /* DIV reset                             */
-            case TimA:
-                if (!gb->newTimALoaded)
-                    gb->io[TimA].r = val; /* Update TIMA if new value wasn't loaded last cycle    */
-                if (gb->nextTimA_IRQ)
-                    gb->nextTimA_IRQ = 0; /* Cancel any pending IRQ when accessing TIMA           */
-                break;
-            case TMA: /* Update TIMA also if TMA is written in the same cycle */
-                if (gb->newTimALoaded)
-                    gb->io[TimA].r = val;
-                break;
+        int i;
+        for (i = 0; i < OAM_SIZE; i++)
+            gb_render_log(gb, 0xFE00 + i, gb->oam[i]);
+    }
 #endif
-            case TimerCtrl: /* TODO: TimA should increase right here if last bit was 1 and current is 0  */
-                gb->io[TimerCtrl].r = val | 0xF8;
-                break;
-            case IntrFlags: /* Mask unused bits for IE and IF         */
-                gb->io[reg].r = val | 0xE0;
-                break;
-            /* APU registers */
-            case NR10 ... Wave + 0xF:
+
+    gb->dmaActive = 1;
+    memset(gb->readPage,  0, sizeof(gb->readPage));
+    memset(gb->writePage, 0, sizeof(gb->writePage));
+#ifdef USE_BLOCK_CACHE
+    gb->block = NULL;
+#endif
+    gb_schedule(gb, EVENT_DMA, BUS_TIME(gb) + DMA_CYCLES);
+}
+
+static void gb_io_boot_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    if (!val)
+        return; /* The boot ROM stays mapped until a non-zero write */
+
+    gb->io[BootROM].r = 0xFF;
+    gb_mem_map_rom(gb);
+}
+
+/* The register table. Unmapped registers keep all bits set when written */
+
+#define IO_UNMAPPED     { 0, 0xFF, NULL, NULL }
+#define IO_TIMER(write) { 0, 0, gb_io_timer_sync, write }
+#define IO_PPU(write)   { 0, 0, gb_io_ppu_sync, write }
+#define IO_APU(mask)    { mask, 0, NULL, gb_io_apu_write },
+
+static const struct gb_io_reg ioRegs[0x100] =
+{
+    [0x03]          = IO_UNMAPPED,
+    [0x08 ... 0x0E] = IO_UNMAPPED,
+    [0x4C ... 0x4F] = IO_UNMAPPED,
+    [0x51 ... 0x7F] = IO_UNMAPPED,
+
+    [Joypad]      = { 0xC0, 0, gb_io_joypad_sync, gb_io_joypad_write },
+    [SerialCtrl]  = { 0x7E, 0, NULL, gb_io_serial_write },
+
+    /* Timer and interrupt flags */
+    [Divider]     = IO_TIMER (gb_io_div_write),
+    [TimA]        = IO_TIMER (gb_io_timer_write),
+    [TMA]         = IO_TIMER (gb_io_timer_write),
+    [TimerCtrl]   = { 0, 0xF8, gb_io_timer_sync, gb_io_timer_write },
+    [IntrFlags]   = { 0xE0, 0, gb_io_timer_sync, gb_io_intr_write },
+    [IntrEnabled] = { 0, 0, NULL, gb_io_ie_write },
+
 #ifdef ENABLE_AUDIO
-                gb_apu_rw(gb, addr & 0xFF, val, write);
-#else
-                gb->io[reg].r = val;
+    /* APU registers, which are read only when audio is turned off */
+    [NR10]        = APU_BITMASKS (IO_APU)
 #endif
-                break;
-            /* PPU registers */
-            case LCDControl:
-            { /* Check whether LCD will be turned on or off */
-                const uint8_t lcdEnabled =  gb->io[LCDControl].LCD_Enable;
-                if (lcdEnabled && !(val & (1 << LCD_Enable)))
-                {
-                    LOG_("GB: [ ] LCD turn off (%d:%d)\n", gb->totalFrames, gb->io[LY].r);
-                    IO_STAT_MODE = 0; /* Clear STAT mode when turning off LCD       */
-                    gb->io[LY].r = 0;
-                }
-                else if (!lcdEnabled && (val & (1 << LCD_Enable)))
-                {
-                    LOG_("GB: [#] LCD turn on  (%d:%d)\n", gb->totalFrames, gb->io[LY].r);
-                }
-                gb->io[LCDControl].r = val;
-                break;
-            }
-            case LY: /* Writing to LY resets line counter      */
-                gb->io[LY].r = val;
-                break;
-            case DMA: /* OAM DMA transfer     */
-                gb->io[DMA].r = val;
-                int i = 0; /* TODO: Make it write across 160 cycles */
-                const uint16_t src = val << 8;
-                while (i < OAM_SIZE)
-                {
-                    gb->oam[i] = CPU_RB(src + i);
-                    i++;
-                }
-                break;
-            case 3: /* Other unmapped registers */
-            case 0x8  ... 0xE:
-            case 0x4C ... 0x7F:
-                gb->io[addr & 0xFF].r = val | 0xFF;
-                break;
-            default:
-                gb->io[addr & 0xFF].r = val;
-        }
-    }
-    return 0;
+    /* PPU registers */
+    [LCDControl]  = IO_PPU (gb_io_lcdc_write),
+    [LCDStatus]   = { 0x80, 0, gb_io_ppu_sync, gb_io_stat_write },
+    [ScrollY]     = IO_PPU (gb_io_ppu_write),
+    [ScrollX]     = IO_PPU (gb_io_ppu_write),
+    [LY]          = IO_PPU (gb_io_ly_write),
+    [LYC]         = IO_PPU (gb_io_lyc_write),
+    [DMA]         = IO_PPU (gb_io_dma_write),
+    [BGPalette ... WindowX] = IO_PPU (gb_io_ppu_write),
+
+    [BootROM]     = { 0, 0xFF, NULL, gb_io_boot_write }
+};
+
+static inline uint8_t gb_io_read(struct GB *gb, const uint8_t reg)
+{
+    const struct gb_io_reg * const io = &ioRegs[reg];
+    if (io->read)
+        io->read(gb);
+
+    return gb->io[reg].r | io->readMask;
+}
+
+static inline void gb_io_write(struct GB *gb, const uint8_t reg, const uint8_t val)
+{
+    const struct gb_io_reg * const io = &ioRegs[reg];
+    if (io->write)
+        io->write(gb, reg, val);
+    else
+        gb->io[reg].r = val | io->writeMask;
 }
 
 inline uint8_t gb_apu_rw(struct GB *gb, const uint8_t reg, const uint8_t val, const uint8_t write)
@@ -211,12 +399,6 @@ uint8_t gb_mem_read(struct GB *gb, const uint16_t addr)
     const uint8_t val = 0;
     INC_MCYCLE;
 
-#if !defined(FAST_TIMING) && defined(USE_TIMER_SIMPLE)
-    ++gb->readWrite;
-    UPDATE_DIV (gb, 4);
-    gb_update_timer_simple (gb, 4);
-#endif
-
     /* For Blargg's CPU instruction tests */
 #ifdef CPU_INSTRS_TESTING
     if (addr == 0xFF44)
@@ -228,65 +410,64 @@ uint8_t gb_mem_read(struct GB *gb, const uint16_t addr)
     }
 #endif
 
-    if (addr < 0x0100 && gb->io[BootROM].r == 0) /* Run boot ROM if needed */
+    /* ROM, work RAM and unlocked video RAM are read directly */
+    const uint8_t * page = gb->readPage[addr >> 8];
+    if (page)
+        return page[addr & 0xFF];
+
+    if (gb->dmaActive && (addr < 0xFF80 || addr == 0xFFFF))
+        return 0xFF; /* Only high RAM is reachable during OAM DMA */
+
+    if (addr >= 0xFF00)
     {
-        return gb->bootRom[addr];
+        if (addr >= 0xFF80 && addr != 0xFFFF)
+            return gb->hram[addr % HRAM_SIZE];  /* High RAM         */
+        return gb_io_read(gb, addr & 0xFF);     /* I/O registers, IE */
     }
-    if (addr < 0x8000)
+    if (addr >= 0xFE00) /* OAM              */
     {
-        return gb->cart.rw(&gb->cart, addr, val, 0); /* ROM from MBC     */
+        if (addr >= 0xFEA0 || !gb->oamAccess)
+            return 0xFF; /* Not usable       */
+
+        return gb->oam[addr - 0xFE00];
     }
-    if (addr < 0xA000)
-    {
-        if (!gb->vramAccess)
-            return 0xFF;
- 
-        return gb->vram[addr & 0x1FFF];
-    } /* Video RAM        */
-    if (addr < 0xC000)
-    {
+    if (addr >= 0xC000)
+        return gb->ram[addr % WRAM_SIZE];       /* Work/echo RAM    */
+    if (addr >= 0xA000)
         return gb->cart.rw(&gb->cart, addr, val, 0); /* External RAM     */
-    }
-    if (addr < 0xE000)
-    {
-        return gb->ram[addr % WRAM_SIZE];
-    } /* Work RAM         */
-    if (addr < 0xFE00)
-    {
-        return gb->ram[addr % WRAM_SIZE];
-    } /* Echo RAM         */
-    if (addr < 0xFEA0) /* OAM              */
-    {
-        if (!gb->oamAccess)
-            return 0xFF;
+    if (addr >= 0x8000)
+        return 0xFF;                            /* Locked video RAM */
 
-        return gb->oam[addr - 0xFE00];
+    if (addr < 0x0100 && gb->io[BootROM].r == 0) /* Run boot ROM if needed */
+        return gb->bootRom[addr];
+
+    return gb->cart.rw(&gb->cart, addr, val, 0); /* ROM from MBC     */
+}
+
+/* Store to video RAM, marking a written tile to be decoded again */
+
+static inline void gb_vram_write(struct GB *gb, const uint16_t addr, const uint8_t val)
+{
+    gb->vram[addr - 0x8000] = val;
+    if (addr < 0x9800)
+    {
+        gb->tileDirty[(addr - 0x8000) >> 7] |= 1 << ((addr >> 4) & 7);
+        gb->tilesDirty = 1;
     }
-    if (addr < 0xFF00)
-        return 0xFF; /* Not usable       */
-    if (addr == 0xFF00)
-        return gb_joypad(gb, val, 0);      /* Joypad           */
-    if (addr < 0xFF80)
-        return gb_io_rw(gb, addr, val, 0); /* I/O registers    */
-    if (addr < 0xFFFF)
-    {
-        return gb->hram[addr % HRAM_SIZE];
-    } /* High RAM         */
-    if (addr == 0xFFFF)
-        return gb->io[IntrEnabled].r;
-        //return gb_io_rw(gb, addr, val, 0); /* Interrupt enable */
-    return 0;
+}
+
+/* Tracked RAM is written through the MBC until the write marks its block,
+   then directly until the block is saved */
+
+static inline uint8_t gb_cart_ram_writable(const struct Cartridge *cart, const uint8_t *page)
+{
+    const uint32_t block = (page - cart->ramData) / RAM_DIRTY_BLOCK;
+    return !cart->trackRAM || (cart->ramDirty[block >> 3] & (1 << (block & 7)));
 }
 
 uint8_t gb_mem_write(struct GB *gb, const uint16_t addr, const uint8_t val)
 {
     INC_MCYCLE;
-    
-#if !defined(FAST_TIMING) && defined(USE_TIMER_SIMPLE)
-    ++gb->readWrite;
-    UPDATE_DIV (gb, 4);
-    gb_update_timer_simple (gb, 4);
-#endif
 
     /* For Blargg's CPU instruction tests */
 #ifdef CPU_INSTRS_TESTING
@@ -297,136 +478,1033 @@ uint8_t gb_mem_write(struct GB *gb, const uint16_t addr, const uint8_t val)
     }
 #endif
 
-    if (addr < 0x0100 && gb->io[BootROM].r == 0) /* Run boot ROM if needed */
+    /* Work RAM is written directly */
+    uint8_t * page = gb->writePage[addr >> 8];
+    if (page)
     {
+        page[addr & 0xFF] = val;
         return 0;
     }
-    if (addr < 0x8000)
+
+    if (gb->dmaActive && (addr < 0xFF80 || addr == 0xFFFF))
+        return 0xFF; /* Only high RAM is reachable during OAM DMA */
+
+    if (addr >= 0xFF00)
     {
-        return gb->cart.rw(&gb->cart, addr, val, 1); /* ROM from MBC     */
+        if (addr >= 0xFF80 && addr != 0xFFFF)
+        {
+            gb->hram[addr % HRAM_SIZE] = val;   /* High RAM         */
+            CODE_WRITE (gb, WRAM_SIZE + (addr % HRAM_SIZE));
+        }
+        else
+            gb_io_write(gb, addr & 0xFF, val);  /* I/O registers, IE */
+        return 0;
     }
-    if (addr < 0xA000)
+    if (addr >= 0xFE00) /* OAM              */
     {
-        if (!gb->vramAccess)
-            return 0xFF;
+        if (addr >= 0xFEA0 || !gb->oamAccess)
+            return 0xFF; /* Not usable       */
 
-        gb->vram[addr & 0x1FFF] = val;
+        PPU_SYNC (gb);
+        gb->oam[addr - 0xFE00] = val;
+        gb->spritesDirty = 1;
+        RENDER_LOG (gb, addr, val);
         return 0;
-    } /* Video RAM        */
-    if (addr < 0xC000)
-    {
-        return gb->cart.rw(&gb->cart, addr, val, 1); /* External RAM     */
     }
-    if (addr < 0xE000)
+    if (addr >= 0xC000)
     {
-        gb->ram[addr % WRAM_SIZE] = val;
+        gb->ram[addr % WRAM_SIZE] = val;        /* Work/echo RAM    */
+        CODE_WRITE (gb, addr % WRAM_SIZE);
         return 0;
-    } /* Work RAM         */
-    if (addr < 0xFE00)
+    }
+    if (addr >= 0xA000)
     {
-        gb->ram[addr % WRAM_SIZE] = val;
-        return 0;
-    } /* Echo RAM         */
-    if (addr < 0xFEA0) /* OAM              */
+        uint8_t * const ramW = gb->cart.ramWritePtr;
+        const uint8_t ret = gb->cart.rw(&gb->cart, addr, val, 1); /* External RAM */
+
+        /* Once marked for saving, the page is written directly */
+        if (ramW && gb_cart_ram_writable(&gb->cart, ramW + (addr & 0x1F00)))
+            gb->writePage[addr >> 8] = ramW + (addr & 0x1F00);
+        return ret;
+    }
+    if (addr >= 0x8000)
     {
-        if (!gb->oamAccess)
-            return 0xFF;
+        if (!gb->vramAccess)
+            return 0xFF;                        /* Locked video RAM */
 
-        gb->oam[addr - 0xFE00] = val;
+        PPU_SYNC (gb);                          /* Video RAM, after lines drawn so far */
+        gb_vram_write (gb, addr, val);
+        RENDER_LOG (gb, addr, val);
         return 0;
     }
-    if (addr < 0xFF00)
-        return 0xFF; /* Not usable       */
-    if (addr == 0xFF00)
-        return gb_joypad(gb, val, 1);      /* Joypad           */
-    if (addr < 0xFF80)
-        return gb_io_rw(gb, addr, val, 1); /* I/O registers    */
-    if (addr < 0xFFFF)
-    {
-        gb->hram[addr % HRAM_SIZE] = val;
-    } /* High RAM         */
-    if (addr == 0xFFFF)
-        gb->io[IntrEnabled].r = val;
-        //return gb_io_rw(gb, addr, val, 1); /* Interrupt enable */
-    return 0;
+
+    if (addr < 0x0100 && gb->io[BootROM].r == 0) /* Run boot ROM if needed */
+        return 0;
+
+    /* MBC registers, which may switch ROM banks */
+    const uint8_t ret = gb->cart.rw(&gb->cart, addr, val, 1);
+    gb_mem_map_rom(gb);
+    return ret;
 }
 
-/*
- **********  Console startup functions  ************
- */
+/* Update the memory map for cartridge banks and the boot ROM */
 
-void gb_init(struct GB *gb, uint8_t *bootRom)
+void gb_mem_map_rom(struct GB *gb)
 {
-    cart_identify(&gb->cart);
-    LOG_("GB: ROM mask: %d\n", gb->cart.romMask);
-    memcpy(gb->extData.title, gb->cart.title, sizeof(gb->cart.title));
+    uint8_t * const bank0 = gb->cart.bank0Ptr;
+    uint8_t * const bankN = gb->cart.bankNPtr;
+    uint8_t * const ramR  = gb->cart.ramReadPtr;
+    uint8_t * const ramW  = gb->cart.ramWritePtr;
 
-    /* Initialize RAM and settings */
-    memset(gb->ram, 0, WRAM_SIZE);
-    memset(gb->vram, 0, VRAM_SIZE);
-    memset(gb->hram, 0, HRAM_SIZE);
-    memset(gb->oam, 0, OAM_SIZE);
+    int p;
+    for (p = 0; p < 0x40; p++)
+    {
+        gb->readPage[p]        = bank0 + (p << 8);
+        gb->readPage[p + 0x40] = bankN + (p << 8);
+    }
+    /* External RAM, or the MBC handles it if not mapped */
+    for (p = 0; p < 0x20; p++)
+    {
+        gb->readPage [p + 0xA0] = ramR ? ramR + (p << 8) : NULL;
+        gb->writePage[p + 0xA0] = (ramW && gb_cart_ram_writable(&gb->cart, ramW + (p << 8))) ?
+            ramW + (p << 8) : NULL;
+    }
+    /* Boot ROM overlaps the first page until it's unmapped */
+    if (gb->io[BootROM].r == 0)
+        gb->readPage[0] = gb->bootRom;
+#ifdef USE_BLOCK_CACHE
+    gb->block = NULL; /* The running block may have been switched out */
+#endif
+}
 
-    memset(gb->io, 0, sizeof(gb->io));
-    LOG_("GB: Memory init done\n");
+/* Use other memory for cartridge RAM, such as a mapped save file. Writes
+   to it are marked in cart.ramDirty from then on. Call gb_mem_map_rom
+   once the marks are cleared, so blocks are tracked again */
 
-    if (bootRom != NULL)
-        gb_reset(gb, bootRom);
-    else
-        gb_boot_reset(gb);
+void gb_cart_ram(struct GB *gb, uint8_t *ram)
+{
+    gb->cart.ramData  = ram;
+    gb->cart.trackRAM = 1;
+    memset(gb->cart.ramDirty, 0, sizeof(gb->cart.ramDirty));
 
-    LOG_CPU_STATE(gb, 0);
-    gb->lineClock = 0;
-    gb->lineClockSt = 0;
-    gb->clock_t = 0;
-    gb->divClock = gb->timAClock = 0;
-    gb->totalFrames = 0;
-    gb->apuDiv = 0;
-    gb->pcInc = 1;
-    LOG_("GB: CPU state done\n");
+    cart_map_banks(&gb->cart);
+    gb_mem_map_rom(gb);
 }
 
-void gb_reset(struct GB *gb, uint8_t *bootROM)
-{
-    LOG_("GB: Load Boot ROM\n");
-    LOG_("GB: Set I/O\n");
+/* Build the page tables. Pages not set here use the bus handlers */
 
-    gb->bootRom = bootROM;
-    gb->extData.joypad = 0xFF;
-    gb->io[Joypad].r = 0xCF;
-    gb_boot_register(gb, 0);
+static void gb_mem_map_pages(struct GB *gb)
+{
+    memset(gb->readPage,  0, sizeof(gb->readPage));
+    memset(gb->writePage, 0, sizeof(gb->writePage));
+
+    gb_mem_map_rom(gb);
+
+    /* Video RAM writes go through the bus, as the PPU catches up first */
+    int p;
+    if (gb->vramAccess)
+        for (p = 0x80; p < 0xA0; p++)
+            gb->readPage[p] = gb->vram + ((p - 0x80) << 8);
+
+    /* Work RAM and echo RAM */
+    for (p = 0xC0; p < 0xFE; p++)
+        gb->readPage[p] = gb->writePage[p] = gb->ram + ((p << 8) % WRAM_SIZE);
+#ifdef USE_BLOCK_CACHE
+    gb_code_protect(gb);
+#endif
+}
 
-    gb->pc = 0;
-    gb->ime = gb->imeDispatched = 0;
-    gb->halted = 0;
-    gb->stopped = 0;
+/* Rebuild the whole memory map, and drop all cached code */
 
-    gb->vramAccess = gb->oamAccess = 1;
+void gb_mem_map(struct GB *gb)
+{
+#ifdef USE_BLOCK_CACHE
+    gb_block_reset(gb);
+#endif
+    gb_mem_map_pages(gb);
 }
 
-void gb_boot_reset(struct GB *gb)
-{
-    gb->bootRom = NULL;
-    gb->extData.joypad = 0xFF;
+/*
+ ****************  Opcode fusion  ******************
+ */
 
-    /* Setup CPU registers as if bootrom was loaded */
-    REG_A = 0x01;
-    gb->flags = 0xB0;
-    REG_B = 0x0;
-    REG_C = 0x13;
-    REG_D = 0x0;
-    REG_E = 0xD8;
-    REG_H = 0x01;
-    REG_L = 0x4D;
-    gb->sp = 0xFFFE;
-    gb->pc = 0x0100;
+#if defined(USE_OP_FUSION) || defined(USE_OP_PROFILE)
 
-    gb->ime = 1;
-    gb->imePending = 0;
-    gb->halted = 0;
-    gb->stopped = 0;
+/* Pairs that gb_cpu_exec has a fused handler for: DEC r followed by a
+   conditional JR, and LD A,(rr) followed by LD (rr),A */
 
-    gb->vramAccess = gb->oamAccess = 1;
+static uint8_t gb_fuse_supported(const uint16_t a, const uint16_t b)
+{
+    if ((a & 0x1C7) == 0x05 && a != 0x35)
+        return (b & 0x1E7) == 0x20;
+    if ((a & 0x1CF) == 0x0A)
+        return (b & 0x1CF) == 0x02;
+    return 0;
+}
+
+#endif
+#ifdef USE_OP_FUSION
+
+/* Pairs that are run fused, as generated by the opcode profiler */
+
+static const uint8_t fusedPairs[][2] =
+{
+#define FUSE_2(A, B)  { A, B },
+#include "opfuse.h"
+#undef FUSE_2
+};
+
+#define FUSED_COUNT  (sizeof(fusedPairs) / sizeof(fusedPairs[0]))
+
+static uint8_t gb_fuse_listed(const uint8_t a, const uint8_t b)
+{
+    uint8_t i;
+    for (i = 0; i < FUSED_COUNT; i++)
+    {
+        if (fusedPairs[i][0] == a && fusedPairs[i][1] == b)
+            return gb_fuse_supported(a, b);
+    }
+    return 0;
+}
+
+#endif
+
+/*
+ ****************  Block cache  ********************
+ */
+#ifdef USE_BLOCK_CACHE
+
+/* Host memory for code at addr. Only ROM, work RAM and high RAM is cached */
+
+static inline const uint8_t * gb_code_page(struct GB *gb, const uint16_t addr)
+{
+    if (addr < 0x8000 || (addr >= 0xC000 && addr < 0xE000))
+        return gb->readPage[addr >> 8];
+    if (addr >= 0xFF80 && addr < 0xFFFF)
+        return gb->hram;
+
+    return NULL;
+}
+
+/* Mark a RAM byte as cached code. Its page is then written through the bus */
+
+static void gb_code_mark(struct GB *gb, const uint16_t addr)
+{
+    if (addr < 0xC000)
+        return;
+
+    const uint16_t i = (addr >= 0xFF80) ? WRAM_SIZE + (addr % HRAM_SIZE) : addr % WRAM_SIZE;
+    gb->codeMap[i >> 3] |= 1 << (i & 7);
+
+    if (addr < 0xE000)
+    {
+        const uint8_t p = addr >> 8;
+        gb->writePage[p] = NULL;
+        if (p + 0x20 < 0xFE)
+            gb->writePage[p + 0x20] = NULL; /* Echo RAM */
+    }
+}
+
+/* Write-protect the work RAM pages holding cached code again, after the
+   page table was rebuilt */
+
+static void gb_code_protect(struct GB *gb)
+{
+    int p, i;
+    for (p = 0xC0; p < 0xE0; p++)
+    {
+        const uint8_t * const map = gb->codeMap + (((p << 8) % WRAM_SIZE) >> 3);
+        for (i = 0; i < (0x100 >> 3); i++)
+        {
+            if (map[i])
+            {
+                gb->writePage[p] = NULL;
+                if (p + 0x20 < 0xFE)
+                    gb->writePage[p + 0x20] = NULL; /* Echo RAM */
+                break;
+            }
+        }
+    }
+}
+
+/* Drop all blocks decoded from the page holding code byte i */
+
+static void gb_code_invalidate(struct GB *gb, const uint16_t i)
+{
+    if (i >= WRAM_SIZE)
+    {
+        memset(gb->codeMap + (WRAM_SIZE >> 3), 0, HRAM_SIZE >> 3);
+        gb->codeGen[0xFF]++;
+    }
+    else
+    {
+        const uint8_t p = 0xC0 + (i >> 8);
+        uint8_t * const page = gb->ram + (i & 0x1F00);
+
+        memset(gb->codeMap + ((i & 0x1F00) >> 3), 0, 0x100 >> 3);
+        gb->writePage[p] = page;
+        if (p + 0x20 < 0xFE)
+            gb->writePage[p + 0x20] = page;
+        gb->codeGen[p]++;
+    }
+    gb->block = NULL;
+}
+
+static inline uint8_t gb_block_ends(const uint8_t op)
+{
+    switch (op)
+    {
+        /* Jumps, calls, returns and restarts */
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7:
+        case 0xC8: case 0xC9: case 0xCA: case 0xCC: case 0xCD: case 0xCF:
+        case 0xD0: case 0xD2: case 0xD4: case 0xD7:
+        case 0xD8: case 0xD9: case 0xDA: case 0xDC: case 0xDF:
+        case 0xE7: case 0xE9: case 0xEF: case 0xF7: case 0xFF:
+        /* HALT, STOP and invalid opcodes */
+        case 0x10: case 0x76:
+        case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4:
+        case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+            return 1;
+    }
+    return 0;
+}
+
+#ifdef USE_IDLE_SKIP
+
+#define IDLE_OK        1 /* Only changes registers              */
+#define IDLE_HL_READ   2 /* Reads memory at HL                  */
+#define IDLE_HL_WRITE  4 /* Changes H or L                      */
+#define IDLE_SKIP_MAX  70224 /* Most cycles skipped at once, a frame */
+
+/* Memory that reads the same until the next event. Timers, audio and
+   cartridge RAM (which may be a clock) change on their own, and joypad
+   reads can request an interrupt */
+
+static uint8_t gb_idle_addr(const uint16_t addr)
+{
+    return !((addr >= 0xA000 && addr < 0xC000) ||
+        (addr >= 0xFF00 && addr <= 0xFF00 + TimerCtrl) ||
+        (addr >= 0xFF00 + NR10 && addr < 0xFF00 + LCDControl));
+}
+
+/* How an instruction may be repeated in a polling loop */
+
+static uint8_t gb_idle_op(const uint8_t *bytes)
+{
+    const uint8_t op = bytes[0];
+    const uint8_t dst = (op >> 3) & 7, src = op & 7;
+
+    if (op >= 0x40 && op < 0xC0)
+    {   /* 8-bit loads and ALU, except HALT and stores to (HL) */
+        if (op == 0x76 || (op < 0x80 && dst == 6))
+            return 0;
+        return IDLE_OK | ((src == 6) ? IDLE_HL_READ : 0) |
+            ((op < 0x80 && (dst == 4 || dst == 5)) ? IDLE_HL_WRITE : 0);
+    }
+    switch (op)
+    {
+        case 0x00: case 0x07: case 0x0F: case 0x17: case 0x1F: /* NOP, rotates  */
+        case 0x27: case 0x2F: case 0x37: case 0x3F:            /* and flags     */
+        case 0x01: case 0x03: case 0x0B: case 0x11: case 0x13: case 0x1B:
+        case 0x04: case 0x05: case 0x0C: case 0x0D: case 0x14: case 0x15:
+        case 0x1C: case 0x1D: case 0x3C: case 0x3D:
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x3E:
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+        case 0xE6: case 0xEE: case 0xF6: case 0xFE:            /* ALU A,n       */
+            return IDLE_OK;
+        case 0x21: case 0x23: case 0x2B:
+        case 0x24: case 0x25: case 0x26: case 0x2C: case 0x2D: case 0x2E:
+            return IDLE_OK | IDLE_HL_WRITE;
+        case 0xF0:                                             /* LDH A,(n)     */
+            return gb_idle_addr(0xFF00 + bytes[1]) ? IDLE_OK : 0;
+        case 0xFA:                                             /* LD A,(nn)     */
+            return gb_idle_addr(bytes[1] | (bytes[2] << 8)) ? IDLE_OK : 0;
+        case 0xCB:
+        {
+            const uint8_t r = bytes[1] & 7;
+            if (bytes[1] >= 0x40 && bytes[1] < 0x80)           /* BIT           */
+                return IDLE_OK | ((r == 6) ? IDLE_HL_READ : 0);
+            if (r == 6)
+                return 0;
+            return IDLE_OK | ((r == 4 || r == 5) ? IDLE_HL_WRITE : 0);
+        }
+    }
+    return 0;
+}
+
+/* Whether the op at pc jumps back to start, when taken */
+
+static uint8_t gb_idle_branch(const uint8_t *bytes, const uint16_t pc, const uint16_t start)
+{
+    switch (bytes[0])
+    {
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+            return (uint16_t)(pc + 2 + (int8_t)bytes[1]) == start;
+        case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA:
+            return (bytes[1] | (bytes[2] << 8)) == start;
+    }
+    return 0;
+}
+
+#endif
+
+/* Decode instructions at PC up to the next jump or the end of the page */
+
+static uint8_t gb_block_decode(struct GB *gb, struct gb_block *b, const uint8_t *base)
+{
+    const uint16_t start = (gb->pc >= 0xFF80) ? 0xFF80 : gb->pc & 0xFF00;
+    const uint32_t end   = (gb->pc >= 0xFF80) ? 0xFFFF : start + 0x100;
+    uint16_t pc = gb->pc;
+
+    b->base = NULL;
+    b->pc = pc;
+    b->gen = gb->codeGen[pc >> 8];
+    b->count = 0;
+#ifdef USE_JIT
+    b->native = NULL;
+    b->hits = 0;
+#endif
+#ifdef USE_IDLE_SKIP
+    uint8_t idle = IDLE_OK, loops = 0;
+#endif
+
+    while (b->count < BLOCK_OPS_MAX)
+    {
+        const uint8_t op  = base[pc - start];
+        const uint8_t len = opLength[op];
+        if (pc + len > end)
+            break;
+
+        struct gb_block_op * const o = &b->ops[b->count++];
+        int i;
+        for (i = 0; i < len; i++)
+        {
+            o->bytes[i] = base[pc - start + i];
+            gb_code_mark(gb, pc + i);
+        }
+        o->handler = NULL;
+        /* CB ops take 2 M-cycles, or 3 to test (HL) and 4 to change it */
+        if (op == 0xCB)
+            o->cycles = ((o->bytes[1] & 7) != 6) ? 2 : ((o->bytes[1] >> 6) == 1) ? 3 : 4;
+        else
+            o->cycles = opCycles[op];
+#ifdef USE_IDLE_SKIP
+        if (gb_block_ends(op))
+            loops = gb_idle_branch(o->bytes, pc, b->pc);
+        else
+            idle = (gb_idle_op(o->bytes) & IDLE_OK) ? idle | gb_idle_op(o->bytes) : 0;
+#endif
+        pc += len;
+
+        if (gb_block_ends(op))
+            break;
+    }
+    if (b->count)
+        b->base = base;
+#ifdef USE_IDLE_SKIP
+    /* Loops back to the start, not reading through HL while changing it */
+    b->idle = (loops && (idle & IDLE_OK) &&
+        !((idle & IDLE_HL_READ) && (idle & IDLE_HL_WRITE))) ? idle : 0;
+#endif
+
+    return b->count;
+}
+
+#ifdef USE_IDLE_SKIP
+
+/* An idle loop that starts twice in a row in the same state, with no
+   event or PPU change in between, repeats exactly until the next one.
+   The passes that would end before then are skipped */
+
+static void gb_idle_skip(struct GB *gb, const struct gb_block *b)
+{
+    FLAGS_SYNC
+    const uint16_t regs[6] = {
+        REG_BC, REG_DE, REG_HL, (REG_A << 8) | gb->flags, gb->sp, gb->ime
+    };
+
+    /* Interrupt dispatch would be counted in the pass */
+    if (!b->idle || gb->rm || ((b->idle & IDLE_HL_READ) && !gb_idle_addr(REG_HL)))
+    {
+        gb->idleBlock = NULL;
+        return;
+    }
+    if (gb->idleBlock == b && gb->idleEvent == gb->nextEvent &&
+        gb->idlePPU == gb->ppuNext && !memcmp(gb->idleRegs, regs, sizeof(regs)))
+    {
+        const uint64_t pass  = gb->clock_t - gb->idleClock;
+        const uint64_t until = (gb->nextEvent < gb->ppuNext) ? gb->nextEvent : gb->ppuNext;
+
+        if (until > gb->clock_t)
+        {
+            const uint64_t ahead = (until - gb->clock_t > IDLE_SKIP_MAX) ?
+                IDLE_SKIP_MAX : until - gb->clock_t - 1;
+            gb->clock_t += ahead / pass * pass;
+        }
+    }
+    gb->idleBlock = b;
+    gb->idleClock = gb->clock_t;
+    gb->idleEvent = gb->nextEvent;
+    gb->idlePPU = gb->ppuNext;
+    memcpy(gb->idleRegs, regs, sizeof(regs));
+}
+
+#endif
+
+/* Start running the block at PC, decoding it if it isn't cached yet */
+
+static struct gb_block * gb_block_lookup(struct GB *gb)
+{
+    const uint8_t * const base = gb_code_page(gb, gb->pc);
+    struct gb_block * const b = &gb->blocks[gb->pc & (BLOCK_CACHE_SIZE - 1)];
+
+    gb->block = NULL;
+    if (!base || ((b->base != base || b->pc != gb->pc || b->gen != gb->codeGen[gb->pc >> 8]) &&
+        !gb_block_decode(gb, b, base)))
+    {
+#ifdef USE_IDLE_SKIP
+        gb->idleBlock = NULL;
+#endif
+        return NULL;
+    }
+
+    gb->block = b;
+    gb->blockIdx = 0;
+    gb->blockPC = gb->pc;
+#ifdef USE_IDLE_SKIP
+    gb_idle_skip(gb, b);
+#endif
+    return b;
+}
+
+#define BLOCK_RUNNING(gb)\
+    (gb->block && gb->pc == gb->blockPC && gb->blockIdx < gb->block->count)
+
+/* Move on to the next op of the running block */
+
+static _FORCE_INLINE uint8_t gb_block_next(struct GB *gb, const struct gb_block *b)
+{
+    gb->fetchOp = &b->ops[gb->blockIdx++];
+    gb->fetchPC = gb->blockPC;
+    gb->blockPC += opLength[gb->fetchOp->bytes[0]];
+
+    INC_MCYCLE;
+    return gb->fetchOp->bytes[0];
+}
+
+/* Fetch the next opcode, from the running block or a new one at PC */
+
+uint8_t gb_block_fetch(struct GB *gb)
+{
+    struct gb_block * b = gb->block;
+
+    /* The halt bug reads the next byte twice, so it isn't cached */
+    if (!gb->pcInc)
+    {
+        gb->block = NULL;
+#ifdef USE_IDLE_SKIP
+        gb->idleBlock = NULL;
+#endif
+        return CPU_RB (gb->pc);
+    }
+
+    if (!BLOCK_RUNNING(gb) && !(b = gb_block_lookup(gb)))
+        return CPU_RB (gb->pc);
+
+    return gb_block_next(gb, b);
+}
+
+/* Store the handler label of each op, given the dispatch tables of
+   gb_cpu_exec, which is the only place the labels can be taken. An op
+   listed as a fused pair with the next one gets the label running both */
+
+static void gb_block_link(struct gb_block *b, const void * const *table, const void * const *fused)
+{
+    uint8_t i;
+    for (i = 0; i < b->count; i++)
+    {
+        b->ops[i].handler = table[b->ops[i].bytes[0]];
+#ifdef USE_OP_FUSION
+        if (i + 1 < b->count && gb_fuse_listed(b->ops[i].bytes[0], b->ops[i + 1].bytes[0]))
+            b->ops[i].handler = fused[b->ops[i].bytes[0]];
+#endif
+    }
+}
+
+void gb_block_reset(struct GB *gb)
+{
+    memset(gb->blocks,  0, sizeof(gb->blocks));
+    memset(gb->codeGen, 0, sizeof(gb->codeGen));
+    memset(gb->codeMap, 0, sizeof(gb->codeMap));
+    gb->block = NULL;
+    gb->fetchOp = NULL;
+}
+
+#ifdef USE_JIT
+
+/* Native code can run only if no scheduled event, such as a PPU mode
+   change or TIMA overflow, falls within its cycles. The PPU and timers
+   are then caught up at once with the same result, and no interrupt
+   can arrive mid-block. */
+
+static uint8_t gb_jit_safe(struct GB *gb, const uint16_t ticks)
+{
+    return gb->clock_t + ticks < gb->nextEvent;
+}
+
+/* Run the recompiled start of the block at PC, if there is one */
+
+uint8_t gb_jit_exec(struct GB *gb)
+{
+    struct gb_block * b;
+    uint32_t ran;
+    uint8_t ops, i;
+
+    if (!gb->pcInc || BLOCK_RUNNING(gb) || !(b = gb_block_lookup(gb)))
+        return 0;
+
+    if (b->native && b->epoch != gb->jitEpoch)
+    {   /* Arena was reused, so the block has to get hot again */
+        b->native = NULL;
+        b->hits = 0;
+    }
+    if (!b->native)
+    {
+        if (++b->hits != JIT_HOT_COUNT)
+            return 0;
+        jit_compile(gb, b);
+        if (!b->native)
+            return 0;
+    }
+    /* A final JR takes one more cycle if it branches */
+    if (!gb_jit_safe(gb, (gb->rm + b->nativeCycles + 1) * 4))
+        return 0;
+
+    FLAGS_SYNC /* Native code reads and writes F directly */
+    ran = b->native(gb);
+    if (!(ops = ran & 0xFF))
+    {   /* The first access isn't to a direct page, such as an I/O poll */
+        b->native = NULL;
+        return 0;
+    }
+
+    if (ops == b->nativeOps)
+    {
+        gb->pc += b->nativeLen;
+        gb->rm += b->nativeCycles;
+    }
+    else for (i = 0; i < ops; i++)
+    {
+        gb->pc += opLength[b->ops[i].bytes[0]];
+        gb->rm += b->ops[i].cycles;
+    }
+    if (ran & JIT_TAKEN)
+    {
+        const uint8_t * const jr = b->ops[ops - 1].bytes;
+        gb->pc += (int8_t) jr[1];
+        if (jr[0] != 0x18)
+            ++gb->rm;
+    }
+    gb->blockIdx = ops;
+    gb->blockPC = gb->pc;
+
+    gb->rt = gb->rm * 4;
+    return 1;
+}
+
+void gb_jit_free(struct GB *gb)
+{
+    jit_free(gb);
+}
+
+#endif
+
+/* Operands of a cached instruction are read without the memory map */
+
+static _FORCE_INLINE uint8_t gb_fetch(struct GB *gb, const uint16_t addr)
+{
+    if (gb->fetchOp)
+    {
+        INC_MCYCLE;
+        return gb->fetchOp->bytes[(uint16_t)(addr - gb->fetchPC)];
+    }
+    return gb_mem_read(gb, addr);
+}
+
+#endif
+
+/*
+ ****************  Opcode profiler  ****************
+ */
+
+#ifdef USE_OP_PROFILE
+
+/* Counts of executed opcode pairs and triples, to find the hottest
+   straight-line sequences. Triples are kept in a hash table by their
+   opcodes. */
+
+#define PROFILE_TRIPLES  0x10000
+
+static uint32_t profPairs[0x200 * 0x200];
+static struct { uint32_t key, count; } profTriples[PROFILE_TRIPLES];
+static uint16_t profLast[2] = { PROFILE_NONE, PROFILE_NONE };
+static uint64_t profTotal;
+
+void gb_profile_op(const uint16_t op)
+{
+    profTotal++;
+    if (profLast[1] != PROFILE_NONE)
+    {
+        profPairs[(profLast[1] << 9) | op]++;
+
+        if (profLast[0] != PROFILE_NONE)
+        {
+            const uint32_t key = ((profLast[0] << 18) | (profLast[1] << 9) | op) + 1;
+            uint32_t h = (key * 2654435761u) >> 16;
+            uint32_t probe;
+
+            for (probe = 0; probe < PROFILE_TRIPLES; probe++, h = (h + 1) & (PROFILE_TRIPLES - 1))
+            {
+                if (profTriples[h].key == key || !profTriples[h].key)
+                {
+                    profTriples[h].key = key;
+                    profTriples[h].count++;
+                    break;
+                }
+            }
+        }
+    }
+    profLast[0] = profLast[1];
+    profLast[1] = op;
+}
+
+/* Interrupts, HALT and native blocks end the current sequence */
+
+void gb_profile_break()
+{
+    profLast[0] = profLast[1] = PROFILE_NONE;
+}
+
+/* Ops that must end a sequence: jumps, calls and returns, interrupt
+   enable changes and the unused opcodes. HALT and STOP aren't counted. */
+
+static uint8_t gb_profile_linear(const uint16_t op, const uint8_t last)
+{
+    if (op == 0x10 || op == 0x76)
+        return 0;
+    if (last || op >= 0x100)
+        return 1;
+
+    switch (op)
+    {
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7: case 0xC8:
+        case 0xC9: case 0xCA: case 0xCC: case 0xCD: case 0xCF: case 0xD0:
+        case 0xD2: case 0xD3: case 0xD4: case 0xD7: case 0xD8: case 0xD9:
+        case 0xDA: case 0xDB: case 0xDC: case 0xDD: case 0xDF: case 0xE3:
+        case 0xE4: case 0xE7: case 0xE9: case 0xEB: case 0xEC: case 0xED:
+        case 0xEF: case 0xF3: case 0xF4: case 0xF7: case 0xFB: case 0xFC:
+        case 0xFD: case 0xFF:
+            return 0;
+    }
+    return 1;
+}
+
+/* Write the most frequent pairs that have a fused handler as the table
+   for opfuse.h, followed by the most frequent straight-line triples as
+   a comment. Counts are cleared as they are written. */
+
+void gb_profile_write(FILE *f, const unsigned int pairs, const unsigned int triples)
+{
+    unsigned int n;
+
+    fprintf(f, "/* Fused opcode pairs, generated by the opcode profiler\r\n"
+        "   (make profile) from %" PRIu64 " executed ops */\r\n\r\n", profTotal);
+
+    for (n = 0; n < pairs; n++)
+    {
+        uint32_t i, best = 0x200 * 0x200;
+        for (i = 0; i < 0x200 * 0x200; i++)
+        {
+            if (profPairs[i] &&
+                (best == 0x200 * 0x200 || profPairs[i] > profPairs[best]) &&
+                gb_fuse_supported(i >> 9, i & 0x1FF))
+                best = i;
+        }
+        if (best == 0x200 * 0x200)
+            break;
+
+        fprintf(f, "FUSE_2 (0x%02X, 0x%02X)  /* %5.2f%% */\r\n",
+            best >> 9, best & 0x1FF, 100.0 * profPairs[best] / profTotal);
+        profPairs[best] = 0;
+    }
+    fprintf(f, "\r\n/* Most frequent straight-line triples. CB prefixed ops are\r\n"
+        "   0x100 + the CB opcode.\r\n\r\n");
+
+    for (n = 0; n < triples; n++)
+    {
+        uint32_t i, best = PROFILE_TRIPLES;
+        for (i = 0; i < PROFILE_TRIPLES; i++)
+        {
+            const uint32_t key = profTriples[i].key - 1;
+            if (profTriples[i].key && profTriples[i].count &&
+                (best == PROFILE_TRIPLES || profTriples[i].count > profTriples[best].count) &&
+                gb_profile_linear(key >> 18, 0) && gb_profile_linear((key >> 9) & 0x1FF, 0) &&
+                gb_profile_linear(key & 0x1FF, 1))
+                best = i;
+        }
+        if (best == PROFILE_TRIPLES)
+            break;
+        {
+            const uint32_t key = profTriples[best].key - 1;
+            fprintf(f, "   0x%03X 0x%03X 0x%03X  %5.2f%%\r\n",
+                key >> 18, (key >> 9) & 0x1FF, key & 0x1FF,
+                100.0 * profTriples[best].count / profTotal);
+            profTriples[best].count = 0;
+        }
+    }
+    fprintf(f, "*/");
+}
+
+#endif
+
+/*
+ ****************  Event scheduler  ****************
+ */
+
+void gb_schedule(struct GB *gb, const uint8_t event, const uint64_t time)
+{
+    uint64_t next = EVENT_NEVER;
+    int i;
+
+    gb->eventTime[event] = time;
+    for (i = 0; i < EVENT_COUNT; i++)
+        if (gb->eventTime[i] < next)
+            next = gb->eventTime[i];
+
+    gb->nextEvent = next;
+}
+
+/* Next PPU threshold, from the line time at its last catch-up */
+
+static void gb_ppu_next(struct GB *gb)
+{
+    if (!gb->io[LCDControl].LCD_Enable)
+    {
+        gb->ppuNext = EVENT_NEVER;
+        return;
+    }
+    const uint16_t next =
+        (gb->io[LY].r >= DISPLAY_HEIGHT) ? TICKS_VBLANK :
+        (gb->lineClock < TICKS_OAM_READ) ? TICKS_OAM_READ :
+        (gb->lineClock < TICKS_TRANSFER) ? TICKS_TRANSFER : TICKS_HBLANK;
+
+    gb->ppuNext = gb->ppuClock + (next - gb->lineClock);
+}
+
+/* The PPU is only caught up when its state is observed, so it only
+   needs an event where it may raise an interrupt. V-blank always does,
+   as it ends the frame. Other lines are checked for enabled STAT sources */
+
+static void gb_ppu_schedule(struct GB *gb)
+{
+    if (!gb->io[LCDControl].LCD_Enable)
+    {
+        gb_schedule(gb, EVENT_PPU, EVENT_NEVER);
+        return;
+    }
+    const uint8_t hblankIRQ = gb->io[LCDStatus].stat_HBlank;
+    const uint8_t oamIRQ    = gb->io[LCDStatus].stat_OAM;
+    const uint8_t lycIRQ    = gb->io[LCDStatus].stat_LYC;
+
+    uint64_t lineStart = gb->ppuClock - gb->lineClock;
+    uint8_t  ly = gb->io[LY].r;
+    uint8_t  vblank = IO_STAT_MODE == Stat_VBlank;
+
+    if (ly < DISPLAY_HEIGHT && hblankIRQ && gb->lineClock < TICKS_TRANSFER)
+    {
+        gb_schedule(gb, EVENT_PPU, lineStart + TICKS_TRANSFER);
+        return;
+    }
+    while (1)
+    {
+        lineStart += TICKS_HBLANK;
+        ly = (ly + 1) % SCAN_LINES;
+        if (ly < DISPLAY_HEIGHT)
+            vblank = 0;
+
+        if ((ly >= DISPLAY_HEIGHT && !vblank) || (ly < DISPLAY_HEIGHT && oamIRQ) ||
+            (ly == gb->io[LYC].r && lycIRQ))
+        {
+            gb_schedule(gb, EVENT_PPU, lineStart);
+            return;
+        }
+        if (ly < DISPLAY_HEIGHT && hblankIRQ)
+        {
+            gb_schedule(gb, EVENT_PPU, lineStart + TICKS_TRANSFER);
+            return;
+        }
+    }
+}
+
+#ifdef ENABLE_AUDIO
+
+/* Next falling edge of DIV bit 4, counted from the given time */
+
+static void gb_div_apu_schedule(struct GB *gb, const uint64_t now)
+{
+    gb_timer_sync(gb, now);
+    const uint32_t cycles = (0x20 - (gb->io[Divider].r & 0x1F)) * 256 - gb->divClock;
+    gb_schedule(gb, EVENT_DIV_APU, now + cycles);
+}
+
+#endif
+
+void gb_run_events(struct GB *gb)
+{
+    while (gb->clock_t >= gb->nextEvent)
+    {
+        uint8_t event = 0;
+        while (gb->eventTime[event] != gb->nextEvent)
+            event++;
+
+        const uint64_t time = gb->eventTime[event];
+        switch (event)
+        {
+            case EVENT_PPU:
+                gb_render(gb, gb->clock_t);
+                gb_ppu_schedule(gb);
+                break;
+            case EVENT_DIV_APU:
+                gb_update_div_apu(gb);
+                gb_schedule(gb, EVENT_DIV_APU, time + DIV_APU_CYCLES);
+                break;
+            case EVENT_SERIAL: /* No link partner, so all 1s are shifted in */
+                gb->io[SerialData].r = 0xFF;
+                gb->io[SerialCtrl].r &= 0x7F;
+                gb_irq_request(gb, IF_Serial);
+                gb_schedule(gb, EVENT_SERIAL, EVENT_NEVER);
+                break;
+            case EVENT_TIMER:
+                gb_timer_sync(gb, gb->clock_t);
+                gb_timer_schedule(gb);
+                break;
+            case EVENT_DMA: /* Give the bus back to the CPU */
+                gb->dmaActive = 0;
+                gb_mem_map_pages(gb);
+                gb_schedule(gb, EVENT_DMA, EVENT_NEVER);
+                break;
+        }
+    }
+}
+
+/*
+ **********  Console startup functions  ************
+ */
+
+void gb_init(struct GB *gb, uint8_t *bootRom)
+{
+#ifdef USE_JIT
+    gb->jitArena = NULL;
+    gb->jitEpoch = 0;
+#endif
+#ifdef USE_RENDER_THREAD
+    gb->renderer = NULL;
+#endif
+    gb->clock_t = 0;
+    gb->cart.clock = &gb->clock_t;
+    cart_identify(&gb->cart);
+    LOG_("GB: ROM mask: %d\n", gb->cart.romMask);
+    memcpy(gb->extData.title, gb->cart.title, sizeof(gb->cart.title));
+
+    /* Initialize RAM and settings */
+    memset(gb->ram, 0, WRAM_SIZE);
+    memset(gb->vram, 0, VRAM_SIZE);
+    memset(gb->tileDirty, 0xFF, sizeof(gb->tileDirty));
+    gb->tilesDirty = 1;
+    memset(gb->hram, 0, HRAM_SIZE);
+    memset(gb->oam, 0, OAM_SIZE);
+    gb->spritesDirty = 1;
+    memset(gb->lineBuf, 0, sizeof(gb->lineBuf));
+    gb->frameOut.next = gb->frameOut.lines = 0;
+
+    memset(gb->io, 0, sizeof(gb->io));
+    LOG_("GB: Memory init done\n");
+#ifdef USE_LAZY_FLAGS
+    gb->lazyOp = LAZY_NONE;
+#endif
+
+    if (bootRom != NULL)
+        gb_reset(gb, bootRom);
+    else
+        gb_boot_reset(gb);
+
+    LOG_CPU_STATE(gb, 0);
+    gb->lineClock = 0;
+    gb->lineClockSt = 0;
+    gb->divClock = gb->timAClock = 0;
+    gb->timerClock = 0;
+    gb->totalFrames = 0;
+    gb->apuDiv = 0;
+    gb->pcInc = 1;
+
+    gb->ppuClock = 0;
+    memset(gb->eventTime, 0xFF, sizeof(gb->eventTime));
+    gb_ppu_next(gb);
+    gb_ppu_schedule(gb);
+    gb_timer_schedule(gb);
+#ifdef ENABLE_AUDIO
+    gb_div_apu_schedule(gb, 0);
+#endif
+    LOG_("GB: CPU state done\n");
+}
+
+void gb_reset(struct GB *gb, uint8_t *bootROM)
+{
+    LOG_("GB: Load Boot ROM\n");
+    LOG_("GB: Set I/O\n");
+
+    gb->bootRom = bootROM;
+    gb->extData.joypad = 0xFF;
+    gb->io[Joypad].r = 0xCF;
+    gb_boot_register(gb, 0);
+
+    gb->pc = 0;
+    gb->ime = gb->imeDispatched = 0;
+    gb->halted = 0;
+    gb->stopped = 0;
+
+    gb->vramAccess = gb->oamAccess = 1;
+    gb->dmaActive = 0;
+    gb_irq_update(gb);
+    gb_mem_map(gb);
+}
+
+void gb_boot_reset(struct GB *gb)
+{
+    gb->bootRom = NULL;
+    gb->extData.joypad = 0xFF;
+
+    /* Setup CPU registers as if bootrom was loaded */
+    REG_A = 0x01;
+    gb->flags = 0xB0;
+    REG_B = 0x0;
+    REG_C = 0x13;
+    REG_D = 0x0;
+    REG_E = 0xD8;
+    REG_H = 0x01;
+    REG_L = 0x4D;
+    gb->sp = 0xFFFE;
+    gb->pc = 0x0100;
+
+    gb->ime = 1;
+    gb->imePending = 0;
+    gb->halted = 0;
+    gb->stopped = 0;
+
+    gb->vramAccess = gb->oamAccess = 1;
+    gb->dmaActive = 0;
 
     LOG_("GB: Launch without boot ROM\n");
     LOG_("GB: Set I/O\n");
@@ -451,19 +1529,190 @@ void gb_boot_reset(struct GB *gb)
     gb->io[WindowY].r     = 0x0;
     gb->io[WindowX].r     = 0x0;
     gb->io[IntrEnabled].r = 0x0;
+    gb_irq_update(gb);
 
     gb_init_audio(gb);
     gb_boot_register(gb, 1);
+    gb_mem_map(gb);
 }
 
 /*
  *****************  CPU functions  *****************
  */
 
-void gb_cpu_exec(struct GB *gb, const uint8_t op)
-{
-    /* Copied value for operands (can be overridden for other opcodes) */
-    uint8_t tmp = REG_A;
+void gb_cpu_exec(struct GB *gb, uint8_t op)
+{
+    /* Copied value for operands (can be overridden for other opcodes) */
+    uint8_t tmp = REG_A;
+
+#ifdef USE_COMPUTED_GOTO
+    static const void * const opTable[0x100] = {
+        OP_ROW(0) OP_ROW(1) OP_ROW(2) OP_ROW(3)
+        OP_ROW(4) OP_ROW(5) OP_ROW(6) OP_ROW(7)
+        OP_ROW(8) OP_ROW(9) OP_ROW(A) OP_ROW(B)
+        OP_ROW(C) OP_ROW(D) OP_ROW(E) OP_ROW(F)
+    };
+#ifdef USE_OP_FUSION
+    /* Handlers for an op with the one after it, by the first opcode */
+    static const void * const fuseTable[0x100] = {
+        [0x05] = &&fuse_05, [0x0D] = &&fuse_0D, [0x15] = &&fuse_15, [0x1D] = &&fuse_1D,
+        [0x25] = &&fuse_25, [0x2D] = &&fuse_2D, [0x3D] = &&fuse_3D,
+        [0x0A] = &&fuse_0A, [0x1A] = &&fuse_1A, [0x2A] = &&fuse_2A, [0x3A] = &&fuse_3A
+    };
+#endif
+
+#ifdef USE_BLOCK_CACHE
+    /* Cached ops jump to the handler stored with them */
+    if (gb->fetchOp)
+    {
+        if (!gb->fetchOp->handler)
+#ifdef USE_OP_FUSION
+            gb_block_link(gb->block, opTable, fuseTable);
+#else
+            gb_block_link(gb->block, opTable, NULL);
+#endif
+        goto *gb->fetchOp->handler;
+    }
+#endif
+    goto *opTable[op];
+
+    /* Halt */
+    op_76:
+        OP(HALT)
+        gb->halted = 1;
+        if (!gb->ime)
+        {
+            if (gb->pendingIRQ)
+                gb->pcInc = gb->halted = 0;
+        }
+        OP_END
+    /* 8-bit load, LD or LDrHL */
+    LBL_r8_hl_lo(4, LD, REG_B)
+    LBL_r8_hl_hi(4, LD, REG_C)
+    LBL_r8_hl_lo(5, LD, REG_D)
+    LBL_r8_hl_hi(5, LD, REG_E)
+    LBL_r8_hl_lo(6, LD, REG_H)
+    LBL_r8_hl_hi(6, LD, REG_L)
+    LBL_r8_hl_hi(7, LD, REG_A)
+    /* 8-bit load, LDHLr */
+    LBL_r8_lo(7, LD_HL, 0)
+
+    op_00: { NOP } OP_END
+    /* 16-bit load, arithmetic instructions */
+    LBL_r16_g1(1, LDrr)
+    LBL_r16_g1(3, INCrr)
+    LBL_r16_g1(9, ADHLrr)
+    LBL_r16_g1(B, DECrr)
+    op_08: { LDmSP } OP_END
+    /* 8-bit load instructions */
+    LBL_r16_g2(2, LDrrmA)
+    LBL_r16_g2(A, LDArrm)
+    /* Increment, decrement, LD r8,n  */
+    LBL_r8_g(4, C, INC, 0)
+    LBL_r8_g(5, D, DEC, 0)
+    LBL_r8_g(6, E, LDrm, 0)
+    /* Opcode group 1 */
+    op_07: { RLCA } OP_END
+    op_17: { RLA }  OP_END
+    op_27: { DAA }  OP_END
+    op_37: { SCF }  OP_END
+    /* STOP and relative jump to nn */
+    op_10: { STOP } OP_END
+    op_18: { JRm }  OP_END
+    /* Opcode group 2 */
+    op_0F: { RRCA } OP_END
+    op_1F: { RRA }  OP_END
+    op_2F: { CPL }  OP_END
+    op_3F: { CCF }  OP_END
+    /* 8-bit arithmetic */
+    LBL_r8_hl_lo(8, ADD, 0)
+    LBL_r8_hl_hi(8, ADC, 0)
+    LBL_r8_hl_lo(9, SUB, 0)
+    LBL_r8_hl_hi(9, SBC, 0)
+    LBL_r8_hl_lo(A, AND, 0)
+    LBL_r8_hl_hi(A, XOR, 0)
+    LBL_r8_hl_lo(B, OR, 0)
+    LBL_r8_hl_hi(B, CP, 0)
+        /* ... */
+    op_C3: { JPNN }   OP_END
+    op_C6: { ADDm }   OP_END
+    op_C9: { RET }    OP_END
+    op_CD: { CALLm }  OP_END
+    op_CE: { ADCm }   OP_END
+
+    op_D6: { SUBm }   OP_END
+    op_D9: { RETI }   OP_END
+    op_DE: { SBCm }   OP_END
+
+    op_E0: { LDHmA }  OP_END
+    op_E2: { LDHCA }  OP_END
+    op_E6: { ANDm }   OP_END
+    op_E8: { ADDSPm } OP_END
+    op_E9: { JPHL }   OP_END
+    op_EA: { LDmmA }  OP_END
+    op_EE: { XORm }   OP_END
+
+    op_F0: { LDHAm }  OP_END
+    op_F2: { LDHAC }  OP_END
+    op_F3: { DI }     OP_END
+    op_F6: { ORm }    OP_END
+    op_F8: { LDHLSP } OP_END
+    op_F9: { LDSPHL } OP_END
+    op_FA: { LDAmm }  OP_END
+    op_FB: { EI }     OP_END
+    op_FE: { CPm }    OP_END
+    /* Conditional jump, return/call */
+    op_20: op_28: op_30: op_38:
+    {
+        const uint8_t cond = ((op >> 3) & 3);
+        JR_(cond)
+    }
+    OP_END
+    op_C0: op_C8: op_D0: op_D8:
+    {
+        const uint8_t cond = ((op >> 3) & 3);
+        RET_(cond)
+    }
+    OP_END
+    op_C2: op_CA: op_D2: op_DA:
+    {
+        const uint8_t cond = ((op >> 3) & 3);
+        JP_(cond)
+    }
+    OP_END
+    op_C4: op_CC: op_D4: op_DC:
+    {
+        const uint8_t cond = ((op >> 3) & 3);
+        CALL_(cond)
+    }
+    OP_END
+    /* Call routines at addresses 0x00 to 0x38 */
+    op_C7: op_CF: op_D7: op_DF: op_E7: op_EF: op_F7: op_FF:
+        { RST } OP_END
+    /* 16-bit push and pop */
+    LBL_r16_g3(1, POPrr)
+    LBL_r16_g3(5, PUSHrr)
+    /* CB prefix ops */
+    op_CB: gb_exec_cb(gb, CPU_RB_PC); OP_END
+
+    op_D3: op_DB: op_DD: op_E3: op_E4: op_EB: op_EC: op_ED: op_F4: op_FC: op_FD:
+        { INVALID }
+        OP_END
+#ifdef USE_OP_FUSION
+    /* Fused op pairs */
+    fuse_05: FUSE_DEC_JR (REG_B) OP_END
+    fuse_0D: FUSE_DEC_JR (REG_C) OP_END
+    fuse_15: FUSE_DEC_JR (REG_D) OP_END
+    fuse_1D: FUSE_DEC_JR (REG_E) OP_END
+    fuse_25: FUSE_DEC_JR (REG_H) OP_END
+    fuse_2D: FUSE_DEC_JR (REG_L) OP_END
+    fuse_3D: FUSE_DEC_JR (REG_A) OP_END
+    fuse_0A: fuse_1A: fuse_2A: fuse_3A:
+        FUSE_LD_COPY OP_END
+#endif
+
+op_done:
+#else
     const uint8_t opHh = op >> 3; /* Octal divisions */
 
     switch (opHh)
@@ -477,7 +1726,7 @@ void gb_cpu_exec(struct GB *gb, const uint8_t op)
                     gb->halted = 1;
                     if (!gb->ime)
                     {
-                        if (gb->io[IntrEnabled].r & gb->io[IntrFlags].r & IF_Any)
+                        if (gb->pendingIRQ)
                             gb->pcInc = gb->halted = 0;
                     }
                     
@@ -639,12 +1888,13 @@ void gb_cpu_exec(struct GB *gb, const uint8_t op)
                 OP_r16_g3(0xC5, PUSHrr)
                 /* CB prefix ops */
                 case 0xCB:
-                    gb_exec_cb(gb, CPU_RB(gb->pc));
+                    gb_exec_cb(gb, CPU_RB_PC);
                     break;
                 default:
                     INVALID
             }
     }
+#endif
 
     /* Handle effects of STOP instruction */
     /* TODO: Read joypad button selection/press */
@@ -663,6 +1913,26 @@ void gb_cpu_exec(struct GB *gb, const uint8_t op)
 #endif
 
     gb->rt = gb->rm * 4;
+
+#if defined(USE_BLOCK_CACHE) && !defined(CPU_LOG_INSTRS)
+    /* Go straight on to the next op of the block when gb_step would do
+       nothing else first: no interrupt is taken, and no event is due
+       until after it */
+    if (gb->fetchOp && BLOCK_RUNNING(gb) && gb->pcInc && !(gb->ime && gb->pendingIRQ) &&
+        gb->clock_t + gb->rt + gb->block->ops[gb->blockIdx].cycles * 4 < gb->nextEvent)
+    {
+        gb->clock_t += gb->rt;
+        gb->rm = 0;
+        op = gb_block_next(gb, gb->block);
+        gb->pc++;
+#ifdef USE_OP_PROFILE
+        if (op != 0xCB)
+            gb_profile_op(op);
+#endif
+        tmp = REG_A;
+        goto *gb->fetchOp->handler;
+    }
+#endif
 }
 
 void gb_exec_cb(struct GB *gb, const uint8_t op_cb)
@@ -672,12 +1942,41 @@ void gb_exec_cb(struct GB *gb, const uint8_t op_cb)
     #endif
 
     ++gb->pc;
+#ifdef USE_OP_PROFILE
+    gb_profile_op(0x100 | op_cb);
+#endif
     const uint8_t opHh = op_cb >> 3; /* Octal divisions */
     const uint8_t r_bit = opHh & 7;
 
     /* Fetch value at address (HL) if it's needed */
     uint8_t hl = 0;
 
+#ifdef USE_COMPUTED_GOTO
+    static const void * const cbTable[0x100] = {
+        CB_ROW(RLC) CB_ROW(RRC) CB_ROW(RL)   CB_ROW(RR)
+        CB_ROW(SLA) CB_ROW(SRA) CB_ROW(SWAP) CB_ROW(SRL)
+        CB_ROW_8(BIT) /* Bit test  */
+        CB_ROW_8(RES) /* Bit reset */
+        CB_ROW_8(SET) /* Bit set   */
+    };
+
+    goto *cbTable[op_cb];
+
+    LBL_CB(RLC)
+    LBL_CB(RRC)
+    LBL_CB(RL)
+    LBL_CB(RR)
+    LBL_CB(SLA)
+    LBL_CB(SRA)
+    LBL_CB(SWAP)
+    LBL_CB(SRL)
+
+    LBL_CB(BIT)
+    LBL_CB(RES)
+    LBL_CB(SET)
+
+cb_done:
+#else
     switch (op_cb)
     {
         OPR_2_(0,    RLC)
@@ -693,6 +1992,7 @@ void gb_exec_cb(struct GB *gb, const uint8_t op_cb)
         OPR_2R_(0x80, RES) /* Bit reset */
         OPR_2R_(0xC0, SET) /* Bit set   */
     }
+#endif
 
     /* Write back to (HL) for most (HL) operations except BIT */
     if ((op_cb & 7) == 6 && (opHh < 8 || opHh > 0xF))
@@ -704,72 +2004,59 @@ void gb_exec_cb(struct GB *gb, const uint8_t op_cb)
     }
 }
 
-/* Update TIMA register */
+/* DIV and TIMA only change on access or at a scheduled overflow, so
+   they are caught up here from the time elapsed since the last update */
 
-inline void gb_update_timer_simple(struct GB *gb, const uint16_t cycles)
+void gb_timer_sync(struct GB *gb, const uint64_t now)
 {
-    if (!gb->io[TimerCtrl].TAC_Enable) /* TIMA counter disabled */
+    if (now <= gb->timerClock)
         return;
 
-    const uint16_t clockRate = TAC_intervals[gb->io[TimerCtrl].TAC_clock];
-    gb->timAClock += cycles;
-
-    /* Exit when clock didn't pass interval */
-    if (gb->timAClock >= clockRate)
-        while (gb->timAClock >= clockRate)
-        {
-            /* Reset clock */
-            gb->timAClock -= clockRate;
-            /* Increment TIMA and request interrupt on TIMA overflow */
-            if (++gb->io[TimA].r == 0)
-            {
-                gb->io[IntrFlags].r |= IF_Timer;
-                gb->io[TimA].r = gb->io[TMA].r;
-            }
-        }
-}
-
-void gb_update_timer(struct GB *gb, const uint8_t change)
-{
-    /* Increment div every m-cycle and save bits 6-13 to DIV register */
-    gb->divClock = (change) ? gb->divClock + 1 : 0;
-    gb->io[Divider].r = (gb->divClock >> 8);
+    const uint64_t cycles = now - gb->timerClock;
+    gb->timerClock = now;
 
-    gb->lastDivClock = gb->divClock;
+    /* Increment DIV every 256 cycles */
+    const uint64_t divClock = gb->divClock + cycles;
+    gb->io[Divider].r += divClock >> 8;
+    gb->divClock = divClock & 0xFF;
 
-    /* Leave if timer is disabled */
-    const uint8_t tac = gb->io[TimerCtrl].r;
-    if ((tac & 4) == 0)
+    if (!gb->io[TimerCtrl].TAC_Enable) /* TIMA counter disabled */
         return;
 
-    /* Update timer, check bits for 1024, 16, 64, or 256 cycles respectively */
-    const uint8_t checkBits[4] = {9, 3, 5, 7};
-    const uint8_t cBit = checkBits[tac & 0x3];
+    const uint16_t clockRate = TAC_intervals[gb->io[TimerCtrl].TAC_clock];
+    const uint64_t timAClock = gb->timAClock + cycles;
+    uint64_t ticks = timAClock / clockRate;
+    gb->timAClock = timAClock % clockRate;
 
-    if (FALLING_EDGE(gb->lastDivClock >> cBit, gb->divClock >> cBit))
+    while (ticks)
     {
-        /* Request timer interrupt if pending */
-        if (++gb->io[TimA].r == 0)
-            gb->nextTimA_IRQ = 1;
+        const uint16_t toOverflow = 0x100 - gb->io[TimA].r;
+        if (ticks < toOverflow)
+        {
+            gb->io[TimA].r += ticks;
+            break;
+        }
+        /* Reload TIMA and request interrupt on TIMA overflow */
+        ticks -= toOverflow;
+        gb->io[TimA].r = gb->io[TMA].r;
+        gb_irq_request(gb, IF_Timer);
     }
 }
 
-void gb_handle_timers(struct GB *gb)
-{
-    gb->newTimALoaded = 0;
+/* Predict the next TIMA overflow from the last update */
 
-    if (gb->nextTimA_IRQ)
+static void gb_timer_schedule(struct GB *gb)
+{
+    if (!gb->io[TimerCtrl].TAC_Enable)
     {
-        /* Check overflow in the next cycle */
-        if (--gb->nextTimA_IRQ == 0)
-        {
-            gb->io[IntrFlags].r |= IF_Timer;
-            gb->io[TimA].r = gb->io[TMA].r;
-            gb->newTimALoaded = 1;
-        }
+        gb_schedule(gb, EVENT_TIMER, EVENT_NEVER);
+        return;
     }
+    const uint16_t clockRate = TAC_intervals[gb->io[TimerCtrl].TAC_clock];
+    const uint32_t toOverflow = (0x100 - gb->io[TimA].r) * clockRate;
 
-    gb_update_timer(gb, 1);
+    gb_schedule(gb, EVENT_TIMER, gb->timerClock +
+        ((gb->timAClock < toOverflow) ? toOverflow - gb->timAClock : 1));
 }
 
 /*
@@ -785,43 +2072,185 @@ enum
     PIXEL_OBJ2 = 12
 };
 
-struct sprite_data
+/* Sorting network for 10 inputs, in 29 compare-exchanges */
+
+static const uint8_t spriteSortNet[29][2] =
 {
-    uint8_t oamEntry;
-    uint8_t x;
+    {0, 8}, {1, 9}, {2, 7}, {3, 5}, {4, 6},
+    {0, 2}, {1, 4}, {5, 8}, {7, 9},
+    {0, 3}, {2, 4}, {5, 7}, {6, 9},
+    {0, 1}, {3, 6}, {8, 9},
+    {1, 5}, {2, 3}, {4, 8}, {6, 7},
+    {1, 2}, {3, 5}, {4, 6}, {7, 8},
+    {2, 3}, {4, 5}, {6, 7},
+    {3, 4}, {5, 6}
 };
 
-#define HIGH_SORT_ACCURACY
+/* List the sprites on each line. The first 10 in OAM on a line are
+   used, and by default sorted by X position, then by OAM offset */
+
+static void gb_sprites_index(struct GB *gb)
+{
+    const uint8_t height = gb->io[LCDControl].OBJ_Size ? 16 : 8;
+    uint16_t keys[DISPLAY_HEIGHT][MAX_SPRITES_LINE];
+    int s, ly;
+
+    memset(gb->lineSpriteCount, 0, sizeof(gb->lineSpriteCount));
+    for (s = 0; s < OAM_SIZE; s += 4)
+    {
+        const int top = gb->oam[s] - 16;
+        const int bottom = (top + height < DISPLAY_HEIGHT) ? top + height : DISPLAY_HEIGHT;
+
+        for (ly = (top < 0) ? 0 : top; ly < bottom; ly++)
+            if (gb->lineSpriteCount[ly] < MAX_SPRITES_LINE)
+                keys[ly][gb->lineSpriteCount[ly]++] = (gb->oam[s + 1] << 8) | s;
+    }
+
+    for (ly = 0; ly < DISPLAY_HEIGHT; ly++)
+    {
+        const uint8_t count = gb->lineSpriteCount[ly];
+        uint16_t * const k = keys[ly];
+
+        if (count > 1 && !gb->extData.oamOrder)
+        {
+            /* Unused inputs sort last */
+            for (s = count; s < MAX_SPRITES_LINE; s++)
+                k[s] = 0xFFFF;
+            for (s = 0; s < 29; s++)
+            {
+                const uint8_t i = spriteSortNet[s][0], j = spriteSortNet[s][1];
+                const uint16_t lo = (k[i] < k[j]) ? k[i] : k[j];
+                k[j] ^= k[i] ^ lo;
+                k[i] = lo;
+            }
+        }
+        for (s = 0; s < count; s++)
+            gb->lineSprites[ly][s] = k[s] & 0xFF;
+    }
+    gb->spriteKey = gb->io[LCDControl].OBJ_Size | (gb->extData.oamOrder << 1);
+    gb->spritesDirty = 0;
+}
+
+/* Decode the tiles written since they were last drawn */
+
+void gb_tiles_update(struct GB *gb)
+{
+    uint16_t i;
+    for (i = 0; i < sizeof(gb->tileDirty); i++)
+    {
+        uint8_t dirty = gb->tileDirty[i];
+        while (dirty)
+        {
+            const uint16_t t = (i << 3) + __builtin_ctz(dirty);
+            const uint8_t *data = gb->vram + (t << 4);
+            uint8_t y, x;
+
+            for (y = 0; y < 8; y++, data += 2)
+                for (x = 0; x < 8; x++)
+                {
+                    const uint8_t palIndex =
+                        ((data[0] >> (7 - x)) & 1) | (((data[1] >> (7 - x)) & 1) << 1);
+                    gb->tiles[0][t][y][x]     = palIndex;
+                    gb->tiles[1][t][y][7 - x] = palIndex;
+                }
+            dirty &= dirty - 1;
+        }
+        gb->tileDirty[i] = 0;
+    }
+    gb->tilesDirty = 0;
+}
+
+/* Fetch the decoded row of the BG or window tile at posX in the map */
+
+static inline const uint8_t * gb_tile_row(const struct GB *gb,
+    const uint16_t tileMap, const uint8_t posX, const uint8_t posY)
+{
+    const uint8_t tileID = gb->vram[(tileMap & 0x1FFF) + (posX >> 3)];
+    /* Select addressing mode */
+    const uint16_t tile = (!(gb->io[LCDControl].BG_Win_Data || (tileID & 0x80)) << 8) + tileID;
+
+    return gb->tiles[0][tile][posY & 7];
+}
+
+/* Copy the rows of the tiles covering count pixels from posX, and
+   return where the first pixel is */
 
-#ifdef HIGH_SORT_ACCURACY
-int compare_sprites(const void * in1, const void * in2)
+static inline const uint8_t * gb_tiles_fetch(const struct GB *gb, uint8_t *buf,
+    const uint16_t tileMap, uint8_t posX, const uint8_t posY, const uint8_t count)
 {
-    const struct sprite_data * sd1, * sd2;
-    int x_res;
+    const uint8_t first = posX & 7;
+    uint8_t i;
+    for (i = 0; i < first + count; i += 8, posX += 8)
+        memcpy(buf + i, gb_tile_row(gb, tileMap, posX, posY), 8);
 
-    sd1 = (struct sprite_data*)in1;
-    sd2 = (struct sprite_data*)in2;
-    x_res = (int)sd1->x - (int)sd2->x;
+    return buf + first;
+}
+
+#ifdef PPU_SIMD
+/* Map 16 palette indexes to colors, with a shuffle or by comparing */
+
+static inline __m128i gb_palette_map16(const __m128i idx, const uint8_t colors[4])
+{
+#ifdef __SSSE3__
+    const __m128i table = _mm_setr_epi8(colors[0], colors[1], colors[2], colors[3],
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    return _mm_shuffle_epi8(table, idx);
+#else
+    __m128i out = _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_setzero_si128()),
+        _mm_set1_epi8(colors[0]));
+    out = _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(1)),
+        _mm_set1_epi8(colors[1])));
+    out = _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(2)),
+        _mm_set1_epi8(colors[2])));
+    return _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(3)),
+        _mm_set1_epi8(colors[3])));
+#endif
+}
+#endif
 
-    if (x_res != 0)
-        return x_res;
+/* Map n palette indexes to the colors in a 4-entry table */
 
-    return (int)sd1->oamEntry - (int)sd2->oamEntry;
+static inline void gb_palette_map(uint8_t *dest, const uint8_t *src,
+    const uint8_t n, const uint8_t colors[4])
+{
+    uint8_t i = 0;
+#ifdef PPU_SIMD
+    for (; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i *)(dest + i),
+            gb_palette_map16(_mm_loadu_si128((const __m128i *)(src + i)), colors));
+#endif
+    for (; i < n; i++)
+        dest[i] = colors[src[i]];
 }
+
+/* Draw a sprite row over 8 pixels. Color 0 is clear, and sprites behind
+   the BG only show over pixels with the color of BG index 0 */
+
+static inline void gb_sprite_row(uint8_t *dest, const uint8_t *row,
+    const uint8_t colors[4], const uint8_t behind, const uint8_t bgColor0)
+{
+#ifdef PPU_SIMD
+    const __m128i idx = _mm_loadl_epi64((const __m128i *)row);
+    const __m128i bg  = _mm_loadl_epi64((const __m128i *)dest);
+
+    __m128i mask = _mm_cmpeq_epi8(idx, _mm_setzero_si128());
+    if (behind)
+        mask = _mm_or_si128(mask, _mm_xor_si128(_mm_set1_epi8(-1), _mm_cmpeq_epi8(
+            _mm_and_si128(bg, _mm_set1_epi8(3)), _mm_set1_epi8(bgColor0))));
+
+    _mm_storel_epi64((__m128i *)dest, _mm_or_si128(_mm_and_si128(mask, bg),
+        _mm_andnot_si128(mask, gb_palette_map16(idx, colors))));
+#else
+    uint8_t x;
+    for (x = 0; x < 8; x++)
+        if (row[x] && !(behind && (dest[x] & 3) != bgColor0))
+            dest[x] = colors[row[x]];
 #endif
+}
 
-#define PPU_GET_TILE(pixelX, X)\
-    /* fetch next tile */\
-    posX = X;\
-    tileID = gb->vram[(tileMap & 0x1FFF) + (posX >> 3)];\
-    px = pixelX;\
-    /* Select addressing mode */\
-    const uint16_t bit12 = !(gb->io[LCDControl].BG_Win_Data || (tileID & 0x80)) << 12;\
-    const uint16_t tile = bit12 + (tileID << 4) + ((posY & 7) << 1);\
-    \
-    rowLSB = gb->vram[tile] >> px;\
-    rowMSB = gb->vram[tile + 1] >> px;\
-    /* End fetch tile macro */
+/* Whether the window is drawn on the current line */
+#define WINDOW_VISIBLE  (gb->io[LCDControl].Window_Enable &&\
+    gb->io[LY].r >= gb->io[WindowY].r && gb->io[WindowX].r <= 166)
 
 /* Stored BG Palette values */
 //uint8_t bgpValues[172 >> 3];
@@ -833,123 +2262,81 @@ int compare_sprites(const void * in1, const void * in2)
 
 static const int_fast16_t bgWinMapAddr[2] = { 0x9800, 0x9C00 };
 
-uint8_t * gb_pixels_fetch(struct GB *gb)
+static void gb_line_compose(struct GB *gb)
 {
-    uint8_t *pixels = gb->extData.pixelLine;
     //assert(gb->io[LY] < DISPLAY_HEIGHT);
-
-    /* If background is enabled, draw it. */
-    if (gb->io[LCDControl].BG_Win_Enable)
+    uint8_t * const line = gb->lineBuf;
+    uint8_t tileBuf[DISPLAY_WIDTH + 16];
+    uint8_t * const visible = line + 8;
+
+    if (gb->tilesDirty)
+        gb_tiles_update(gb);
+
+    /* BG colors for each palette index */
+    const uint8_t bgColors[4] = {
+        (BGP_VAL & 3) | PIXEL_BG, ((BGP_VAL >> 2) & 3) | PIXEL_BG,
+        ((BGP_VAL >> 4) & 3) | PIXEL_BG, ((BGP_VAL >> 6) & 3) | PIXEL_BG
+    };
+
+    /* The window covers the BG from its left edge onwards */
+    const uint8_t window = WINDOW_VISIBLE;
+    const uint8_t winLeft = !window ? DISPLAY_WIDTH :
+        (gb->io[WindowX].r < 7 ? 0 : gb->io[WindowX].r - 7);
+
+    /* If background is disabled, the last line is left as it was */
+    if (gb->io[LCDControl].BG_Win_Enable && winLeft > 0)
     {
-        //if (!(gb->io[LCDControl].Window_Enable && gb->io[LY].r >= gb->io[WindowY].r))
-        //{    
-            /* BG tile fetcher gets tile ID. Bits 0-4 define X loction, bits 5-9 define Y location
-             * All related calculations following are found here:
-             * https://github.com/ISSOtm/pandocs/blob/rendering-internals/src/Rendering_Internals.md */
-    
-            uint8_t lineX = DISPLAY_WIDTH - 1;
-            if (gb->io[LCDControl].Window_Enable &&
-                gb->io[LY].r >= gb->io[WindowY].r && gb->io[WindowX].r <= 166)
-            {
-                lineX = (gb->io[WindowX].r < 7 ? 0 : gb->io[WindowX].r - 7) - 1;
-            }
-    
-            /* Calculate current background line to draw */
-            const uint8_t posY = gb->io[LY].r + gb->io[ScrollY].r;
-            /* Get selected background map address for first tile
-             * corresponding to current line  */
-            uint16_t tileMap = bgWinMapAddr[BGAREA_VAL] | ((posY >> 3) << 5);
-
-            uint8_t posX, px, tileID, rowLSB, rowMSB;
-            PPU_GET_TILE(7 - (posX & 7), lineX + gb->io[ScrollX].r)
-            const uint8_t end = 0xFF;
-    
-            for (; lineX != end; --lineX)
-            {
-                if ((px & 7) == 0)
-                {
-                    tileMap = bgWinMapAddr[BGAREA_VAL] | ((posY >> 3) << 5);
-                    PPU_GET_TILE(0, lineX + gb->io[ScrollX].r)
-                }
-                /* Get background color */
-                uint8_t palIndex = (rowLSB & 0x1) | ((rowMSB & 0x1) << 1);
-                pixels[lineX] = ((BGP_VAL >> (palIndex << 1)) & 3) | PIXEL_BG;
-    
-                rowLSB >>= 1;
-                rowMSB >>= 1;
-                ++px;
-            }
-        //}
+        /* BG tile fetcher gets tile ID. Bits 0-4 define X loction, bits 5-9 define Y location
+         * All related calculations following are found here:
+         * https://github.com/ISSOtm/pandocs/blob/rendering-internals/src/Rendering_Internals.md */
+
+        /* Calculate current background line to draw */
+        const uint8_t posY = gb->io[LY].r + gb->io[ScrollY].r;
+        /* Get selected background map address for first tile
+         * corresponding to current line  */
+        const uint16_t tileMap = bgWinMapAddr[BGAREA_VAL] | ((posY >> 3) << 5);
+
+        const uint8_t * src = gb_tiles_fetch(gb, tileBuf, tileMap,
+            gb->io[ScrollX].r, posY, winLeft);
+        gb_palette_map(visible, src, winLeft, bgColors);
     }
 
     /* draw window */
-    if (gb->io[LCDControl].Window_Enable && 
-        gb->io[LY].r >= gb->io[WindowY].r && gb->io[WindowX].r <= 166)
+    if (window)
     {
         /* Calculate Window Map Address. */
         const uint16_t tileMap = bgWinMapAddr[gb->io[LCDControl].Window_Area] |
                 ((gb->windowLY >> 3) << 5);
 
-        uint8_t lineX = DISPLAY_WIDTH - 1;
-        const uint8_t posY = gb->windowLY & 7;
-
-        uint8_t posX, px, tileID, rowLSB, rowMSB;
-        PPU_GET_TILE(7 - (posX & 7), lineX - gb->io[WindowX].r + 7)
-        const uint8_t end = (gb->io[WindowX].r < 7 ? 0 : gb->io[WindowX].r - 7) - 1;
-
-        for (; lineX != end; --lineX)
-        {
-            if ((px & 7) == 0)
-            {
-                PPU_GET_TILE(0, lineX - gb->io[WindowX].r + 7)
-            }
-            uint8_t palIndex = (rowLSB & 0x1) | ((rowMSB & 0x1) << 1);
-            pixels[lineX] = (((BGP_VAL) >> (palIndex << 1)) & 3) | PIXEL_BG;
-
-            rowLSB >>= 1;
-            rowMSB >>= 1;
-            ++px;
-        }
+        const uint8_t * src = gb_tiles_fetch(gb, tileBuf, tileMap,
+            winLeft - gb->io[WindowX].r + 7, gb->windowLY, DISPLAY_WIDTH - winLeft);
+        gb_palette_map(visible + winLeft, src, DISPLAY_WIDTH - winLeft, bgColors);
         ++gb->windowLY;
     }
 
-#define MAX_SPRITES_LINE 10
-#define NUM_SPRITES 40
-
     if (gb->io[LCDControl].OBJ_Enable)
     {
-        uint8_t totalSprites = 0;
-
-        /* Record number of sprites on the line being rendered, limited
-         * to the maximum number sprites that the Game Boy is able to
-         * render on each line (10 sprites). */
-        struct sprite_data sprites[MAX_SPRITES_LINE];
-
-        /* Find available sprites that could be visible on this line */
+        /* Sprites visible on this line, limited to the 10 the Game Boy
+         * can render, and already sorted into drawing order */
+        if (gb->spritesDirty ||
+            gb->spriteKey != (gb->io[LCDControl].OBJ_Size | (gb->extData.oamOrder << 1)))
+            gb_sprites_index(gb);
+
+        const uint8_t * sprites = gb->lineSprites[gb->io[LY].r];
+        const uint8_t totalSprites = gb->lineSpriteCount[gb->io[LY].r];
         uint8_t s;
-        for (s = 0; s < OAM_SIZE; s += 4)
-        {
-            if (gb->oam[s + 1] == 0 && gb->oam[s + 1] >= DISPLAY_WIDTH)
-                continue;
-            if (gb->io[LY].r >= gb->oam[s] - (gb->io[LCDControl].OBJ_Size ? 0 : 8) ||
-                gb->io[LY].r < gb->oam[s] - 16)
-                continue;
-
-            sprites[totalSprites].oamEntry = s;
-            sprites[totalSprites++].x = gb->oam[s + 1];
+        /* Sprite colors for each palette and index */
+        const uint8_t objColors[2][4] = {
+            { (gb->io[OBJPalette0].r & 3) | PIXEL_OBJ1, ((gb->io[OBJPalette0].r >> 2) & 3) | PIXEL_OBJ1,
+              ((gb->io[OBJPalette0].r >> 4) & 3) | PIXEL_OBJ1, ((gb->io[OBJPalette0].r >> 6) & 3) | PIXEL_OBJ1 },
+            { (gb->io[OBJPalette1].r & 3) | PIXEL_OBJ2, ((gb->io[OBJPalette1].r >> 2) & 3) | PIXEL_OBJ2,
+              ((gb->io[OBJPalette1].r >> 4) & 3) | PIXEL_OBJ2, ((gb->io[OBJPalette1].r >> 6) & 3) | PIXEL_OBJ2 }
+        };
 
-            if (totalSprites == MAX_SPRITES_LINE)
-                break;
-        }
-#ifdef HIGH_SORT_ACCURACY
-        /* Sort sprites by coordinate and object location in OAM.
-         * TODO: Maybe forgo qsort for a sparse array if performance differs */
-        qsort(sprites, totalSprites, sizeof(sprites[0]), compare_sprites);
-#endif
         /* Sprites are rendered from low priority to high priority */
         for (s = totalSprites - 1; s != 0xFF; s--)
         {
-            const uint8_t entry = sprites[s].oamEntry;
+            const uint8_t entry = sprites[s];
             const uint8_t objX = gb->oam[entry + 1];
 
             /* Skip sprite if not visible */
@@ -966,41 +2353,78 @@ uint8_t * gb_pixels_fetch(struct GB *gb)
             const uint8_t objTile = (gb->oam[entry + 2] & 
                 (gb->io[LCDControl].OBJ_Size ? 0xFE : 0xFF));
 
-            const uint8_t rowLSB = gb->vram[(objTile << 4) | (posY << 1)];
-            const uint8_t rowMSB = gb->vram[(objTile << 4) | ((posY << 1) + 1)];
+            /* Decoded row, mirrored for X flip */
+            const uint8_t * row = gb->tiles[(objFlags >> 5) & 1][objTile + (posY >> 3)][posY & 7];
 
-            const uint8_t sLeft = (objX < 8) ? 8 : objX;
-            const uint8_t sRight = (objX >= DISPLAY_WIDTH) ? DISPLAY_WIDTH : objX;
+            /* Handle sprite priority, and set pixels based on palette */
+            gb_sprite_row(line + objX, row, objColors[(objFlags >> 4) & 1],
+                objFlags & 0x80, BGP_VAL & 3);
+        }
+    }
+}
 
-            /* Loop through tile row pixels */
-            uint8_t lineX;
-            for (lineX = sLeft - 8; lineX != sRight; lineX++)
-            {
-                /* handle X flip */
-                const uint8_t relX = (gb->oam[entry + 3] & 0x20) ? lineX - objX : 7 - (lineX - objX);
-                const uint8_t palIndex =
-                    ((rowLSB >> (relX & 7)) & 1) |
-                    (((rowMSB >> (relX & 7)) & 1) << 1);
-
-                /* Handle sprite priority */
-                if (palIndex && !(objFlags & 0x80 && !((pixels[lineX] & 0x3) == (BGP_VAL & 3))))
-                {
-                    /* Set pixel based on palette */
-                    pixels[lineX] = (objFlags & 0x10) ?
-                        ((gb->io[OBJPalette1].r >> (palIndex << 1)) & 3):
-                        ((gb->io[OBJPalette0].r >> (palIndex << 1)) & 3);
+uint8_t * gb_pixels_fetch(struct GB *gb)
+{
+    gb_line_compose(gb);
+    memcpy(gb->extData.pixelLine, gb->lineBuf + 8, DISPLAY_WIDTH);
+    return gb->extData.pixelLine;
+}
 
-                    pixels[lineX] &= 3;
-                    pixels[lineX] |= (objFlags & 0x10) ? PIXEL_OBJ2 : PIXEL_OBJ1;
-                }
-            }
-        }
+/* Draw the line straight into the frame being drawn, in its format */
+
+static void gb_frame_line(struct GB *gb, const uint8_t ly)
+{
+    struct gb_frame_st * const out = &gb->frameOut;
+    const uint8_t * const src = gb->lineBuf + 8;
+    uint8_t * dst = out->buffers[out->next] + ly * DISPLAY_WIDTH * out->format;
+    uint8_t x;
+
+    gb_line_compose(gb);
+    switch (out->format)
+    {
+        case GB_FRAME_INDEX:
+            memcpy(dst, src, DISPLAY_WIDTH);
+            break;
+        case GB_FRAME_RGB:
+            /* Four bytes are stored at a time, the last one overwritten
+               by the next pixel */
+            for (x = 0; x < DISPLAY_WIDTH - 1; x++, dst += 3)
+                memcpy(dst, out->colors[src[x]], 4);
+            memcpy(dst, out->colors[src[x]], 3);
+            break;
+        default:
+            for (x = 0; x < DISPLAY_WIDTH; x++, dst += 4)
+                memcpy(dst, out->colors[src[x]], 4);
+    }
+    ++out->lines;
+}
+
+/* Draw the line into the frame, or pass it to draw_line without one */
+
+static inline void gb_line_draw(struct GB *gb, const uint8_t ly)
+{
+    if (gb->frame_ready)
+        gb_frame_line(gb, ly);
+    else
+    {
+        gb_pixels_fetch(gb);
+        gb->draw_line (gb->extData.ptr, gb->extData.pixelLine, ly);
     }
-    return pixels;
 }
 
-#undef MAX_SPRITES_LINE
-#undef NUM_SPRITES
+/* Pass a finished frame on, and start drawing into the next buffer.
+   Frames without any lines drawn, as when skipped, aren't passed on */
+
+static void gb_frame_done(struct GB *gb)
+{
+    struct gb_frame_st * const out = &gb->frameOut;
+    if (!out->lines)
+        return;
+
+    gb->frame_ready(gb->extData.ptr, out->buffers[out->next]);
+    out->next  = (out->next + 1) % out->count;
+    out->lines = 0;
+}
 
 inline void gb_oam_read(struct GB *gb)
 {
@@ -1009,7 +2433,7 @@ inline void gb_oam_read(struct GB *gb)
     {
         IO_STAT_MODE = Stat_OAM_Search;
         if (gb->io[LCDStatus].stat_OAM)
-            gb->io[IntrFlags].r |= IF_LCD_STAT; /* Mode 2 interrupt */
+            gb_irq_request(gb, IF_LCD_STAT); /* Mode 2 interrupt */
         /* Fetch OAM data for sprites to be drawn on this line */
         // ppu_OAM_fetch (ppu, io_regs);
     }
@@ -1038,7 +2462,7 @@ inline void gb_transfer(struct GB *gb)
     {\
         gb->io[LCDStatus].stat_LYC_LY = 1;\
         if (gb->io[LCDStatus].stat_LYC)\
-            gb->io[IntrFlags].r |= IF_LCD_STAT;\
+            gb_irq_request(gb, IF_LCD_STAT);\
     }\
     else /* Unset the flag */\
         gb->io[LCDStatus].stat_LYC_LY = 0;\
@@ -1046,71 +2470,320 @@ inline void gb_transfer(struct GB *gb)
 
 #define PPU_PACE  TICKS_HBLANK / 6
 
-void gb_render(struct GB *const gb)
+#ifdef USE_RENDER_THREAD
+
+/* Lines are recorded with the PPU registers they were drawn with, and
+   the VRAM and OAM writes made before them. The renderer replays them
+   in order on its own copy of the PPU state, so lines come out the same
+   as drawn inline. Recording alternates between two lists: the CPU
+   thread hands one over and takes the other back once it's drawn */
+
+#define RENDER_WRITES_MAX  0x4000
+#define RENDER_SPINS       64     /* Yields before the renderer sleeps */
+#define RENDER_PAUSE_NS    50000
+
+struct gb_line_state
 {
-    gb->lineClock += gb->rt;
+    uint8_t  ly, lcdc, scy, scx, wy, wx, bgp, obp0, obp1;
+    uint8_t  windowLY, oamOrder;
+    uint16_t writeEnd; /* Writes made before the line */
+};
 
-    if (gb->io[LY].r < DISPLAY_HEIGHT)
+struct gb_render_write
+{
+    uint16_t addr;
+    uint8_t  val;
+};
+
+struct gb_render_list
+{
+    struct gb_line_state   lines [DISPLAY_HEIGHT];
+    struct gb_render_write writes[RENDER_WRITES_MAX];
+    uint16_t lineCount, writeCount;
+    uint8_t  frameEnd; /* Set if it ends a frame */
+    int ready; /* Set when handed over, cleared once drawn */
+};
+
+struct gb_renderer
+{
+    struct GB shadow; /* PPU state the lines are drawn from */
+    struct gb_render_list lists[2];
+    uint8_t   recIndex;
+    int       quit;
+    pthread_t thread;
+};
+
+static void gb_render_replay(struct GB *gb, const struct gb_render_write *w)
+{
+    if (w->addr >= 0xFE00)
     {
-        /* Visible line, within screen bounds */
-        if (gb->lineClock < TICKS_OAM_READ)
-            gb_oam_read(gb);
-        else if (gb->lineClock < TICKS_TRANSFER)
-            gb_transfer(gb);
-        else if (gb->lineClock < TICKS_HBLANK)
-        { /* Mode 0 - H-blank */
-            if (IO_STAT_MODE != Stat_HBlank)
-            {
-                IO_STAT_MODE = Stat_HBlank;
-                /* Mode 0 interrupt */
-                if (gb->io[LCDStatus].stat_HBlank)
-                    gb->io[IntrFlags].r |= IF_LCD_STAT;
-
-                if ((!gb->io[LCDControl].LCD_Enable) || (gb->extData.frameSkip &&
-                    (gb->totalFrames % (gb->extData.frameSkip + 1) != 0)))
-                    return;
-#if ENABLE_LCD
-                const uint8_t oddFrame = gb->totalFrames & 1;
-                if (gb->extData.interlace && ((gb->io[LY].r + oddFrame) & 1))
-                    return;
+        gb->oam[w->addr - 0xFE00] = w->val;
+        gb->spritesDirty = 1;
+    }
+    else
+        gb_vram_write(gb, w->addr, w->val);
+}
 
-                /* Fetch line of pixels for the screen and draw them */
-                gb_pixels_fetch(gb);
-                gb->draw_line (gb->extData.ptr, gb->extData.pixelLine, gb->io[LY].r);
-#endif
-            }
-        }
-        else
-        { /* Starting new line */
-            gb->lineClock -= TICKS_HBLANK;
-            gb->io[LY].r = (gb->io[LY].r + 1) % SCAN_LINES;
-            GB_EVAL_LYC(gb);
-        }
+static void gb_render_draw(struct GB *gb, const struct gb_render_list *list)
+{
+    uint16_t i, w = 0;
+    for (i = 0; i < list->lineCount; i++)
+    {
+        const struct gb_line_state *line = &list->lines[i];
+        for (; w < line->writeEnd; w++)
+            gb_render_replay(gb, &list->writes[w]);
+
+        gb->io[LY].r          = line->ly;
+        gb->io[LCDControl].r  = line->lcdc;
+        gb->io[ScrollY].r     = line->scy;
+        gb->io[ScrollX].r     = line->scx;
+        gb->io[WindowY].r     = line->wy;
+        gb->io[WindowX].r     = line->wx;
+        gb->io[BGPalette].r   = line->bgp;
+        gb->io[OBJPalette0].r = line->obp0;
+        gb->io[OBJPalette1].r = line->obp1;
+        gb->windowLY          = line->windowLY;
+        gb->extData.oamOrder  = line->oamOrder;
+
+        gb_line_draw(gb, line->ly);
     }
-    else /* Outside of screen Y bounds */
+    for (; w < list->writeCount; w++)
+        gb_render_replay(gb, &list->writes[w]);
+
+    if (list->frameEnd && gb->frame_ready)
+        gb_frame_done(gb);
+}
+
+static void * gb_render_main(void *arg)
+{
+    struct gb_renderer * const r = arg;
+    uint8_t index = 0;
+
+    while (1)
     {
-        if (gb->lineClock < TICKS_VBLANK)
+        struct gb_render_list * const list = &r->lists[index];
+        unsigned spins = 0;
+
+        /* Poll for the next list, sleeping briefly once it's been a while */
+        while (!__atomic_load_n(&list->ready, __ATOMIC_ACQUIRE))
         {
-            if (IO_STAT_MODE != Stat_VBlank)
+            if (__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE))
+                return NULL;
+            if (++spins < RENDER_SPINS)
+                sched_yield();
+            else
             {
-                /* Enter Vblank and indicate that a frame is completed */
-                IO_STAT_MODE = Stat_VBlank;
-                gb->io[IntrFlags].r |= IF_VBlank;
-                gb->drawFrame = 1;
-                /* Mode 1 interrupt */
-                if (gb->io[LCDStatus].stat_VBlank)
-                    gb->io[IntrFlags].r |= IF_LCD_STAT;
+                const struct timespec pause = { 0, RENDER_PAUSE_NS };
+                nanosleep(&pause, NULL);
             }
         }
+        gb_render_draw(&r->shadow, list);
+        __atomic_store_n(&list->ready, 0, __ATOMIC_RELEASE);
+        index ^= 1;
+    }
+}
+
+/* Hand over the lines and writes recorded so far, then wait until the
+   other list is free to record into */
+
+static void gb_render_flush(struct GB *gb, const uint8_t frameEnd)
+{
+    struct gb_renderer * const r = gb->renderer;
+    struct gb_render_list * list = &r->lists[r->recIndex];
+
+    if (!list->lineCount && !list->writeCount && !frameEnd)
+        return;
+
+    list->frameEnd = frameEnd;
+    __atomic_store_n(&list->ready, 1, __ATOMIC_RELEASE);
+    r->recIndex ^= 1;
+    list = &r->lists[r->recIndex];
+    while (__atomic_load_n(&list->ready, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    list->lineCount = list->writeCount = 0;
+}
+
+static void gb_render_log(struct GB *gb, const uint16_t addr, const uint8_t val)
+{
+    struct gb_render_list * list = &gb->renderer->lists[gb->renderer->recIndex];
+    if (list->writeCount == RENDER_WRITES_MAX)
+    {
+        gb_render_flush(gb, 0);
+        list = &gb->renderer->lists[gb->renderer->recIndex];
+    }
+    list->writes[list->writeCount].addr = addr;
+    list->writes[list->writeCount++].val = val;
+}
+
+/* Record a line to be drawn, keeping the window line count as drawing
+   it would */
+
+static void gb_render_record(struct GB *gb)
+{
+    struct gb_render_list * list = &gb->renderer->lists[gb->renderer->recIndex];
+    if (list->lineCount == DISPLAY_HEIGHT)
+    {
+        gb_render_flush(gb, 0);
+        list = &gb->renderer->lists[gb->renderer->recIndex];
+    }
+    struct gb_line_state * const line = &list->lines[list->lineCount++];
+
+    line->ly       = gb->io[LY].r;
+    line->lcdc     = gb->io[LCDControl].r;
+    line->scy      = gb->io[ScrollY].r;
+    line->scx      = gb->io[ScrollX].r;
+    line->wy       = gb->io[WindowY].r;
+    line->wx       = gb->io[WindowX].r;
+    line->bgp      = gb->io[BGPalette].r;
+    line->obp0     = gb->io[OBJPalette0].r;
+    line->obp1     = gb->io[OBJPalette1].r;
+    line->windowLY = gb->windowLY;
+    line->oamOrder = gb->extData.oamOrder;
+    line->writeEnd = list->writeCount;
+
+    if (WINDOW_VISIBLE)
+        ++gb->windowLY;
+}
+
+uint8_t gb_render_start(struct GB *gb)
+{
+    struct gb_renderer * r;
+    if (posix_memalign((void **)&r, 64, sizeof(struct gb_renderer)))
+        return 0;
+
+    memset(r, 0, sizeof(struct gb_renderer));
+    memcpy(r->shadow.vram, gb->vram, VRAM_SIZE);
+    memcpy(r->shadow.oam,  gb->oam,  OAM_SIZE);
+    memcpy(r->shadow.lineBuf, gb->lineBuf, sizeof(gb->lineBuf));
+    memset(r->shadow.tileDirty, 0xFF, sizeof(r->shadow.tileDirty));
+    r->shadow.tilesDirty   = 1;
+    r->shadow.spritesDirty = 1;
+    r->shadow.extData.ptr  = gb->extData.ptr;
+    r->shadow.draw_line    = gb->draw_line;
+    r->shadow.frameOut     = gb->frameOut;
+    r->shadow.frame_ready  = gb->frame_ready;
+
+    if (pthread_create(&r->thread, NULL, gb_render_main, r))
+    {
+        free(r);
+        return 0;
+    }
+    gb->renderer = r;
+    return 1;
+}
+
+/* Wait until every recorded line has been drawn */
+
+void gb_render_sync(struct GB *gb)
+{
+    struct gb_renderer * const r = gb->renderer;
+    if (!r)
+        return;
+
+    gb_render_flush(gb, 0);
+    while (__atomic_load_n(&r->lists[0].ready, __ATOMIC_ACQUIRE) ||
+           __atomic_load_n(&r->lists[1].ready, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+void gb_render_stop(struct GB *gb)
+{
+    struct gb_renderer * const r = gb->renderer;
+    if (!r)
+        return;
+
+    gb_render_sync(gb);
+    __atomic_store_n(&r->quit, 1, __ATOMIC_RELEASE);
+    pthread_join(r->thread, NULL);
+    free(r);
+    gb->renderer = NULL;
+}
+#endif
+
+/* Mode 0 - H-blank, where the finished line is drawn */
+
+static void gb_hblank(struct GB *const gb)
+{
+    IO_STAT_MODE = Stat_HBlank;
+    /* Mode 0 interrupt */
+    if (gb->io[LCDStatus].stat_HBlank)
+        gb_irq_request(gb, IF_LCD_STAT);
+
+    if (gb->extData.frameSkip &&
+        (gb->totalFrames % (gb->extData.frameSkip + 1) != 0))
+        return;
+#if ENABLE_LCD
+    const uint8_t oddFrame = gb->totalFrames & 1;
+    if (gb->extData.interlace && !gb->frame_ready && ((gb->io[LY].r + oddFrame) & 1))
+        return;
+#ifdef USE_RENDER_THREAD
+    if (gb->renderer)
+    {
+        gb_render_record(gb);
+        return;
+    }
+#endif
+    /* Fetch line of pixels for the screen and draw them */
+    gb_line_draw(gb, gb->io[LY].r);
+#endif
+}
+
+/* Starting new line */
+
+static void gb_new_line(struct GB *const gb)
+{
+    gb->lineClock = 0;
+    gb->io[LY].r = (gb->io[LY].r + 1) % SCAN_LINES;
+    if (gb->io[LY].r > DISPLAY_HEIGHT)
+        gb->windowLY = 0; /* Reset window Y counter if line is 0 */
+    GB_EVAL_LYC(gb);
+
+    if (gb->io[LY].r < DISPLAY_HEIGHT)
+        gb_oam_read(gb);
+    else if (IO_STAT_MODE != Stat_VBlank)
+    {
+        /* Enter Vblank and indicate that a frame is completed */
+        IO_STAT_MODE = Stat_VBlank;
+        gb_irq_request(gb, IF_VBlank);
+        gb->drawFrame = 1;
+#ifdef USE_RENDER_THREAD
+        /* Hand the frame's lines over to be drawn */
+        if (gb->renderer)
+            gb_render_flush(gb, 1);
         else
-        { /* Starting new line */
-            gb->io[LY].r = (gb->io[LY].r + 1) % SCAN_LINES;
-            gb->lineClock -= TICKS_VBLANK;
-            if (gb->io[LY].r > DISPLAY_HEIGHT)
-                gb->windowLY = 0; /* Reset window Y counter if line is 0 */
-            GB_EVAL_LYC(gb);
-        }
+#endif
+        if (gb->frame_ready)
+            gb_frame_done(gb);
+        /* Mode 1 interrupt */
+        if (gb->io[LCDStatus].stat_VBlank)
+            gb_irq_request(gb, IF_LCD_STAT);
+    }
+}
+
+/* Catch the PPU up to the given time. Each mode change happens at the
+   exact cycle its threshold is reached, in order */
+
+void gb_render(struct GB *const gb, const uint64_t now)
+{
+    while (now >= gb->ppuNext)
+    {
+        gb->lineClock += gb->ppuNext - gb->ppuClock;
+        gb->ppuClock = gb->ppuNext;
+
+        if (gb->lineClock == TICKS_OAM_READ)
+            gb_transfer(gb);
+        else if (gb->lineClock == TICKS_TRANSFER)
+            gb_hblank(gb);
+        else
+            gb_new_line(gb);
+
+        gb_ppu_next(gb);
     }
+    if (gb->io[LCDControl].LCD_Enable)
+        gb->lineClock += now - gb->ppuClock;
+
+    gb->ppuClock = now;
     /* ...and DMA transfer to OMA, if needed */
 }
 
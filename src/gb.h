@@ -1,7 +1,23 @@
 #ifndef GB_H
 #define GB_H
 
+/* The recompiler only targets x86-64 Linux. It, idle loop skipping and
+   opcode fusion all run from the block cache, which jumps between the
+   computed goto handlers of its ops */
+#if defined(USE_JIT) && !(defined(__x86_64__) && defined(__linux__))
+    #undef USE_JIT
+#endif
+#if (defined(USE_JIT) || defined(USE_IDLE_SKIP) || defined(USE_OP_FUSION)) && !defined(USE_BLOCK_CACHE)
+    #define USE_BLOCK_CACHE
+#endif
+#if defined(USE_BLOCK_CACHE) && !defined(USE_COMPUTED_GOTO)
+    #define USE_COMPUTED_GOTO
+#endif
+
 #include <string.h>
+#ifdef USE_OP_PROFILE
+    #include <stdio.h>
+#endif
 #include "cart.h"
 #include "io.h"
 #include "ops.h"
@@ -15,13 +31,75 @@
 
 #define BOOT_ROM_SIZE       0x100
 #define VRAM_SIZE           0x2000
+#define VRAM_TILES          384
 #define WRAM_SIZE           0x2000
 #define OAM_SIZE            0xA0
+#define MAX_SPRITES_LINE    10
 #define HRAM_SIZE           0x80
 #define IO_SIZE             0x100
 
 #define GB_FRAME_RATE       (CPU_FREQ_DMG / FRAME_CYCLES)
 
+#define BLOCK_CACHE_SIZE    0x400 /* Cached blocks, indexed by start address */
+#define BLOCK_OPS_MAX       16    /* Most instructions decoded per block     */
+
+#define SERIAL_CYCLES       4096  /* 8 bits shifted out at 8192 Hz           */
+#define DIV_APU_CYCLES      8192  /* Falling edge of DIV bit 4, at 512 Hz    */
+#define HALT_CYCLES_MAX     70224 /* Longest HALT step, if nothing is due    */
+#define DMA_CYCLES          640   /* OAM DMA, one byte per M-cycle           */
+
+#define PROFILE_NONE        0xFFFF /* No opcode, in profiled sequences       */
+
+/* Timed events, checked once per step instead of polling each unit */
+
+enum gb_event
+{
+    EVENT_PPU = 0,  /* Next PPU mode or line change   */
+    EVENT_DIV_APU,  /* Frame sequencer step           */
+    EVENT_SERIAL,   /* Serial transfer completed      */
+    EVENT_TIMER,    /* TIMA overflow                  */
+    EVENT_DMA,      /* OAM DMA finished               */
+    EVENT_COUNT
+};
+
+#define EVENT_NEVER         UINT64_MAX
+
+/* Formats frames can be drawn in, by bytes per pixel */
+
+enum gb_frame_format
+{
+    GB_FRAME_INDEX = 1, /* Pixel values, as passed to draw_line */
+    GB_FRAME_RGB   = 3, /* First three bytes of each value's color */
+    GB_FRAME_RGBA  = 4  /* All four bytes of each value's color    */
+};
+
+#define GB_FRAME_BUFFERS_MAX 3
+
+#ifdef USE_LAZY_FLAGS
+/* Last ALU op whose flags haven't been written to F yet */
+
+enum gb_lazy_op
+{
+    LAZY_NONE = 0,  /* F is up to date                */
+    LAZY_ADD,       /* ADD, ADC                       */
+    LAZY_SUB,       /* SUB, SBC, CP                   */
+    LAZY_INC,       /* INC r, which keeps the carry   */
+    LAZY_DEC,       /* DEC r, which keeps the carry   */
+    LAZY_AND,       /* AND, which also sets H         */
+    LAZY_LOGIC      /* XOR, OR                        */
+};
+#endif
+
+/* Keeps bulk memory off the cache lines holding the hot CPU state */
+
+#define CACHE_LINE_SIZE     64
+
+#ifdef __GNUC__
+    #define GB_CACHE_ALIGN  __attribute__((aligned(CACHE_LINE_SIZE)))
+#else
+    #define GB_CACHE_ALIGN
+#endif
+
 /* Assign register pair as 16-bit union */
 
 #define REG_16(XY, X, Y)\
@@ -46,8 +124,44 @@
 #define REG_DE   gb->de.r16
 #define REG_HL   gb->hl.r16
 
+/* Predecoded straight-line run of instructions */
+
+struct GB;
+typedef uint32_t (*gb_native_fn)(struct GB *);
+
+struct gb_block
+{
+    const uint8_t * base;  /* Host memory the block was decoded from */
+    uint32_t gen;          /* Code page generation when decoded      */
+    uint16_t pc;
+    uint8_t  count;
+#ifdef USE_JIT
+    /* Recompiled leading instructions of the block, once it's hot */
+    gb_native_fn native;
+    uint32_t epoch;
+    uint16_t hits;
+    uint8_t  nativeOps, nativeLen, nativeCycles;
+#endif
+#ifdef USE_IDLE_SKIP
+    uint8_t  idle;         /* Polling loop that can be skipped ahead  */
+#endif
+
+    /* Each instruction, with the gb_cpu_exec label that runs it. Labels
+       are filled in when the block first runs */
+    struct gb_block_op
+    {
+        const void * handler;
+        uint8_t bytes[3];  /* Opcode and immediate operands */
+        uint8_t cycles;    /* Static M-cycles, with branches not taken */
+    }
+    ops[BLOCK_OPS_MAX];
+};
+
 struct GB
 {
+    /* Hot CPU state, touched by nearly every step. Kept together at the
+       start so it fits in the first cache line. */
+
     /* A-F, H, L - 8-bit registers */
     REG_16(af, f, a);
     REG_16(bc, c, b);
@@ -57,16 +171,6 @@ struct GB
     /* Register bitfields */
     /* Assumes little-endian for the host platform. */
 
-    union
-    {
-        struct {
-            uint8_t f, a, c, b, e, d, l, h;
-        } r8;
-        struct {
-            uint16_t af, bc, de, hl; 
-        } r16;
-    };
-
     union
     {
         struct 
@@ -80,43 +184,103 @@ struct GB
         uint8_t flags;
     };
 
-    union regValues io[IO_SIZE];
-    
+    /* HALT and STOP status, PC increment toggle */
+    uint8_t halted : 1, stopped : 1, pcInc : 1;
+
+    /* Interrupt master enable and PC increment */
+    uint8_t ime : 1;
+    uint8_t imePending : 1;
+    uint8_t imeDispatched : 1;
+    uint8_t pendingIRQ;    /* IE & IF, updated when either changes */
+
     /* Other CPU registers / general timekeeping */
     uint16_t pc, sp;
     uint16_t nn;
+#ifdef USE_LAZY_FLAGS
+    /* Operands of the last ALU op, for working out its flags later */
+    uint16_t lazyRes; /* Result, with the carry flag in bit 8 */
+    uint8_t  lazyOp;
+    uint8_t  lazyX;   /* Both operands XORed, for the half carry */
+#endif
+    uint_fast16_t rm;     /* Tracks individual step cycles */
+    uint32_t      rt;
     uint64_t clock_t;
+    uint64_t nextEvent;   /* Earliest of the scheduled event times */
+
+    /* Warm state, used by memory accesses and most blocks */
+#ifdef USE_BLOCK_CACHE
+    struct gb_block * block;            /* Block currently being run     */
+    const struct gb_block_op * fetchOp; /* Instruction currently running */
+    uint16_t blockPC, fetchPC;          /* Next and current op addresses */
+    uint8_t  blockIdx;
+#endif
+    uint64_t ppuNext;  /* Time of its next mode or line change */
+
+    /* Memory map with direct pointers to each 256-byte page.
+       NULL pages are accessed through the bus handlers instead. */
+    uint8_t * readPage [0x100];
+    uint8_t * writePage[0x100];
+
+    /* I/O registers and high RAM, reached through the bus handlers */
+    union regValues io[IO_SIZE];
+    uint8_t hram[HRAM_SIZE];   /* High RAM  */
+
+    /* PPU related tracking */
+    uint64_t ppuClock; /* Time the PPU was last caught up to */
     uint16_t lineClock;
     uint16_t lineClockSt;
     uint8_t  drawFrame;
+    uint8_t  vramAccess : 1, oamAccess : 1, dmaActive : 1, tilesDirty : 1;
+    uint8_t  spritesDirty : 1;
+    uint8_t  windowLY;
+    uint8_t  lastJoypad;
     uint32_t totalFrames;
 
-    /* Timer data */
-    uint_fast16_t divClock, lastDivClock;
+    /* Timer data, brought up to date only when needed */
+    uint64_t      timerClock; /* Time of the last timer update */
+    uint_fast16_t divClock;
     uint_fast16_t timAClock;
-    uint_fast8_t  timAOverflow, nextTimA_IRQ, newTimALoaded;
-    uint_fast16_t rm, rt; /* Tracks individual step cycles */
     uint_fast8_t  apuDiv;
 
-    /* HALT and STOP status, PC increment toggle */
-    uint8_t halted : 1, stopped : 1, pcInc : 1;
+    /* Scheduled event times */
+    uint64_t eventTime[EVENT_COUNT];
 
-    /* PPU related tracking */
-    uint8_t vramAccess : 1, oamAccess : 1;
-    uint8_t readWrite;
-    uint8_t windowLY;
-
-    /* Memory and I/O registers */
-    uint8_t ram [WRAM_SIZE];   /* Work RAM  */
-    uint8_t vram[VRAM_SIZE];
-    uint8_t oam [OAM_SIZE];
-    uint8_t hram[HRAM_SIZE];   /* High RAM  */
+#ifdef USE_IDLE_SKIP
+    /* State when the start of an idle loop was last reached */
+    const struct gb_block * idleBlock;
+    uint64_t idleClock, idleEvent, idlePPU;
+    uint16_t idleRegs[6];
+#endif
 
-    /* Interrupt master enable and PC increment */
-    uint8_t ime : 1;
-    uint8_t imePending : 1;
-    uint8_t imeDispatched : 1;
-    uint8_t lastJoypad;
+    /* Bulk memories, each starting on its own cache line */
+    uint8_t ram [WRAM_SIZE] GB_CACHE_ALIGN;   /* Work RAM  */
+    uint8_t vram[VRAM_SIZE] GB_CACHE_ALIGN;
+    uint8_t oam [OAM_SIZE]  GB_CACHE_ALIGN;
+
+    /* Tiles decoded to a palette index per pixel, and mirrored for
+       X-flipped sprites. Written tiles are decoded again before drawing */
+    uint8_t tiles[2][VRAM_TILES][8][8] GB_CACHE_ALIGN;
+    uint8_t tileDirty[VRAM_TILES / 8];
+
+    /* OAM offsets of the sprites on each line, in drawing order. Rebuilt
+       before drawing when OAM, the sprite size or the order changes */
+    uint8_t lineSprites[DISPLAY_HEIGHT][MAX_SPRITES_LINE];
+    uint8_t lineSpriteCount[DISPLAY_HEIGHT];
+    uint8_t spriteKey; /* Sprite size and order the lists were built for */
+
+    /* Line being drawn, with 8 pixels to each side which sprites partly
+       off screen can be drawn over. Kept for lines without a background */
+    uint8_t lineBuf[DISPLAY_WIDTH + 16];
+
+#ifdef USE_BLOCK_CACHE
+    /* Decoded instruction blocks. Pages in work RAM holding cached code
+       have no write page, so writes to them can invalidate blocks. */
+    struct gb_block blocks[BLOCK_CACHE_SIZE] GB_CACHE_ALIGN;
+    uint32_t codeGen[0x100];            /* Code write generation by page */
+    uint8_t  codeMap[(WRAM_SIZE + HRAM_SIZE) / 8]; /* Cached code bytes  */
+#endif
+
+    /* Cold state, used once per line or frame, or only on setup */
 #ifdef ENABLE_AUDIO
     /* Audio channel data */
     struct {
@@ -128,7 +292,7 @@ struct GB
         uint16_t lengthTick;
         uint8_t  envTick   : 4;
     }
-    audioCh[4];
+    audioCh[4] GB_CACHE_ALIGN;
 
     uint8_t  sweepEnabled : 1;
     uint8_t  sweepTick : 4;
@@ -139,7 +303,7 @@ struct GB
     uint32_t wavSample, sampleCount;
 #endif
     /* Catridge which holds ROM and RAM */
-    struct Cartridge cart;
+    struct Cartridge cart GB_CACHE_ALIGN;
     uint8_t * bootRom;
 
     /* Directly accessible external data */
@@ -148,22 +312,72 @@ struct GB
         uint8_t joypad;
         uint8_t frameSkip;
         uint8_t interlace;
+        uint8_t oamOrder;  /* Overlap sprites in OAM order, not by X */
         uint8_t pixelLine[DISPLAY_WIDTH];
         uint8_t title[16];
         void *  ptr;
     }
     extData;
 
+    /* Frames drawn straight into buffers owned by the frontend, in turn,
+       when frame_ready is set. Each finished frame is passed to it, and
+       isn't drawn over until count - 1 more have been. Colors are given
+       for each pixel value, and lines are never interlaced */
+    struct gb_frame_st
+    {
+        uint8_t * buffers[GB_FRAME_BUFFERS_MAX];
+        const uint8_t (*colors)[4];
+        uint8_t count;
+        uint8_t format;
+        uint8_t next;   /* Buffer being drawn into    */
+        uint8_t lines;  /* Lines drawn into it so far */
+    }
+    frameOut;
+
     /* Functions that rely on external data */
     void (*draw_line)    (void *, const uint8_t * pixels, const uint8_t line);
+    void (*frame_ready)  (void *, uint8_t * frame);
     void (*debug_cpu_log)(void *, const uint8_t);
+
+#ifdef USE_JIT
+    /* Executable memory for this instance's recompiled blocks */
+    uint8_t * jitArena;
+    uint32_t  jitUsed, jitEpoch;
+#endif
+#ifdef USE_RENDER_THREAD
+    /* Lines recorded to be drawn on another thread, NULL to draw inline */
+    struct gb_renderer * renderer;
+#endif
 };
 
 uint8_t gb_apu_rw     (struct GB *, const uint8_t  reg,  const uint8_t val, const uint8_t write);
 uint8_t gb_mem_read   (struct GB *, const uint16_t addr);
 uint8_t gb_mem_write  (struct GB *, const uint16_t addr, const uint8_t val);
 
+void gb_mem_map     (struct GB *);
+void gb_mem_map_rom (struct GB *);
+void gb_cart_ram    (struct GB *, uint8_t * ram);
+
+#ifdef USE_BLOCK_CACHE
+uint8_t gb_block_fetch (struct GB *);
+void    gb_block_reset (struct GB *);
+#endif
+#ifdef USE_JIT
+uint8_t gb_jit_exec    (struct GB *);
+/* Releases recompiled code. Call before gb_init again, or before the GB
+   goes away */
+void    gb_jit_free    (struct GB *);
+#endif
+#ifdef USE_OP_PROFILE
+/* Opcodes are counted as 0x100 + the CB opcode for CB prefixed ones */
+void gb_profile_op    (const uint16_t op);
+void gb_profile_break (void);
+void gb_profile_write (FILE *, const unsigned int pairs, const unsigned int triples);
+#endif
+
 void gb_init       (struct GB *, uint8_t *);
+void gb_schedule   (struct GB *, const uint8_t, const uint64_t);
+void gb_run_events (struct GB *);
 void gb_cpu_exec   (struct GB *, const uint8_t op);
 void gb_exec_cb    (struct GB *, const uint8_t op);
 void gb_reset      (struct GB *, uint8_t *);
@@ -171,14 +385,22 @@ void gb_boot_reset (struct GB *);
 
 /* Other update-specific functions */
 
-void gb_handle_timers       (struct GB *);
-void gb_update_timer        (struct GB *, const uint8_t);
-void gb_update_timer_simple (struct GB *, const uint16_t);
+void gb_timer_sync          (struct GB *, const uint64_t);
 
-void gb_render              (struct GB *);
+void gb_render              (struct GB *, const uint64_t);
 void gb_oam_read            (struct GB *);
 void gb_transfer            (struct GB *);
 uint8_t * gb_pixels_fetch   (struct GB *);
+void gb_tiles_update        (struct GB *);
+
+#ifdef USE_RENDER_THREAD
+/* Draw lines on a worker thread, from gb_init until stopped. Call sync
+   before reading what draw_line wrote, and stop before gb_init again.
+   Frame output set up by then is drawn, and passed on, by the worker */
+uint8_t gb_render_start     (struct GB *);
+void gb_render_sync         (struct GB *);
+void gb_render_stop         (struct GB *);
+#endif
 
 void gb_init_audio          (struct GB *);
 void gb_ch_trigger          (struct GB *, const uint8_t);
@@ -203,6 +425,20 @@ static inline void gb_boot_register (struct GB * const gb, const uint8_t val)
  ********  General emulator input/update  **********
 */
 
+/* Interrupts that are both requested and enabled, kept up to date with
+   IE and IF so each step only has to test one byte */
+
+static inline void gb_irq_update (struct GB * gb)
+{
+    gb->pendingIRQ = gb->io[IntrEnabled].r & gb->io[IntrFlags].r & IF_Any;
+}
+
+static inline void gb_irq_request (struct GB * gb, const uint8_t flag)
+{
+    gb->io[IntrFlags].r |= flag;
+    gb_irq_update (gb);
+}
+
 static inline uint8_t gb_joypad (struct GB * gb, const uint8_t val, const uint8_t write)
 {
     if (!write)
@@ -219,7 +455,7 @@ static inline uint8_t gb_joypad (struct GB * gb, const uint8_t val, const uint8_
 
             if (btnLast == 1 && btnCurr == 0)
             {
-                gb->io[IntrFlags].r |= IF_Joypad;
+                gb_irq_request (gb, IF_Joypad);
                 break;
             }
         }
@@ -236,14 +472,50 @@ static inline uint8_t gb_joypad (struct GB * gb, const uint8_t val, const uint8_
     return 0;
 }
 
-static inline uint8_t gb_handle_interrupts(struct GB *gb)
+#ifdef USE_LAZY_FLAGS
+
+/* Carry and zero flags as they would be after the last ALU op. Every
+   lazy op leaves the carry in bit 8 of the result. */
+
+static inline uint8_t gb_flag_c(const struct GB *gb)
 {
-    /* Get interrupt flags */
-    const uint8_t io_IE = gb->io[IntrEnabled].r;
-    const uint8_t io_IF = gb->io[IntrFlags].r;
+    return (gb->lazyOp == LAZY_NONE) ? gb->f_c : (gb->lazyRes >> 8) & 1;
+}
+
+static inline uint8_t gb_flag_z(const struct GB *gb)
+{
+    return (gb->lazyOp == LAZY_NONE) ? gb->f_z : !(gb->lazyRes & 0xFF);
+}
 
+/* Write the flags of the last ALU op to F, before F is read or only
+   partly changed */
+
+static inline void gb_flags_sync(struct GB *gb)
+{
+    const uint8_t res = gb->lazyRes & 0xFF;
+    const uint8_t c   = (gb->lazyRes >> 8) & 1;
+    const uint8_t h   = ((gb->lazyX ^ gb->lazyRes) >> 4) & 1;
+    uint8_t f;
+
+    switch (gb->lazyOp)
+    {
+        case LAZY_NONE: return;
+        case LAZY_ADD:  f = h << 5;                             break;
+        case LAZY_SUB:  f = 0x40 | (h << 5);                    break;
+        case LAZY_INC:  f = ((res & 0xF) == 0) << 5;            break;
+        case LAZY_DEC:  f = 0x40 | (((res & 0xF) == 0xF) << 5); break;
+        case LAZY_AND:  f = 0x20;                               break;
+        default:        f = 0;                                  break;
+    }
+    gb->flags  = f | ((res == 0) << 7) | (c << 4);
+    gb->lazyOp = LAZY_NONE;
+}
+#endif
+
+static inline uint8_t gb_handle_interrupts(struct GB *gb)
+{
     /* Run if CPU ran HALT instruction or IME enabled w/flags */
-    if ((gb->ime || gb->halted) && (io_IF & io_IE & IF_Any)) 
+    if ((gb->ime || gb->halted) && gb->pendingIRQ)
     {
         gb->halted = 0;
 
@@ -266,20 +538,19 @@ static inline uint8_t gb_handle_interrupts(struct GB *gb)
 
         if (gb->imeDispatched)
         {
-            /* Check all 5 IE and IF bits for flag confirmations
-            This loop also services interrupts by priority (0 = highest) */
-            uint8_t f;
-            uint8_t addr = 0x40;
-            for (f = IF_VBlank; f <= IF_Joypad; f <<= 1)
+            /* Service the lowest pending bit, which has the highest priority.
+               If pushing PC overwrote IE and cancelled it, jump to 0 instead */
+            if (gb->pendingIRQ)
             {
-                if ((gb->io[IntrEnabled].r & f) && (gb->io[IntrFlags].r & f))
-                    break;
-                addr += 8;
-            }
+                const uint8_t n = __builtin_ctz (gb->pendingIRQ);
 
-            /* Jump to vector address and clear flag bit */
-            gb->pc = addr;
-            gb->io[IntrFlags].r ^= f;
+                /* Jump to vector address and clear flag bit */
+                gb->pc = 0x40 + (n << 3);
+                gb->io[IntrFlags].r ^= 1 << n;
+                gb_irq_update (gb);
+            }
+            else
+                gb->pc = 0;
         }
     }
 
@@ -289,13 +560,12 @@ static inline uint8_t gb_handle_interrupts(struct GB *gb)
     return gb->imeDispatched;
 }
 
-#define USE_TIMER_SIMPLE
-
 #ifndef CPU_LOG_INSTRS
     #define LOG_CPU_STATE(gb, op)
     #else
     #define cpu_read(X)   gb_mem_access (gb, X, 0, 0)
     #define LOG_CPU_STATE(gb, op) {\
+        FLAGS_SYNC\
         LOG_("op: %02X "\
             "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X "\
             "SP:%04X PC:%04X LY:%3d mode: %d\n",\
@@ -305,80 +575,72 @@ static inline uint8_t gb_handle_interrupts(struct GB *gb)
     }
 #endif
 
-#ifdef ENABLE_AUDIO
-    #define UPDATE_DIV_APU   { gb_update_div_apu(gb); }
+/* Load next op and execute */
+
+static inline uint8_t gb_exec_next (struct GB * gb)
+{
+#ifdef USE_BLOCK_CACHE
+    const uint8_t op = gb_block_fetch (gb);
 #else
-    #define UPDATE_DIV_APU   { }
+    const uint8_t op = CPU_RB (gb->pc);
 #endif
+    if (!gb->pcInc) /* Enable halt bug PC count or continue as normal */
+        gb->pcInc = 1;
+    else
+        gb->pc++;
+#ifdef USE_OP_PROFILE
+    if (op != 0xCB) /* CB ops are counted once their second byte is read */
+        gb_profile_op (op);
+#endif
+    gb_cpu_exec (gb, op);
+#ifdef USE_BLOCK_CACHE
+    gb->fetchOp = NULL;
+#endif
+    LOG_CPU_STATE (gb, op);
 
-#ifdef USE_TIMER_SIMPLE /* Update DIV register */
-
-#define UPDATE_DIV(gb, cycles)\
-    gb->divClock += cycles;\
-    while (gb->divClock >= 256)\
-    {\
-        const uint_fast8_t lastDiv = gb->io[Divider].r;\
-        ++gb->io[Divider].r;\
-        gb->divClock -= 256;\
-        if (!(gb->io[Divider].r & 0x10) && lastDiv & 0x10)\
-            UPDATE_DIV_APU \
-    }\
+    return op;
+}
 
+#ifdef USE_OP_PROFILE
+    #define PROFILE_BREAK  gb_profile_break();
+#else
+    #define PROFILE_BREAK
 #endif
 
 static inline void gb_step (struct GB * gb)
 {
     gb->rt = 0;
     gb->rm = 0;
-    gb->readWrite = 0;
     
     if (gb_handle_interrupts (gb))
     {
         gb->imeDispatched = 0;
+        PROFILE_BREAK
     }
     if (gb->halted)
     {
-        /* Next interrupt can be predicted, so move clock ahead accordingly */
-        const uint16_t ticks = 
-            (gb->lineClock > TICKS_TRANSFER) ? TICKS_HBLANK - gb->lineClock :
-            (gb->lineClock > TICKS_OAM_READ) ? TICKS_TRANSFER - gb->lineClock :
-            TICKS_OAM_READ - gb->lineClock;
+        PROFILE_BREAK
+        /* Interrupts are only requested by scheduled events, so move the
+           clock ahead to the next one, in whole M-cycles */
+        const uint64_t ticks = (gb->nextEvent - gb->clock_t < HALT_CYCLES_MAX) ?
+            gb->nextEvent - gb->clock_t : HALT_CYCLES_MAX;
 
-        gb->rt += (ticks == 0) ? 4 : ticks;
+        gb->rt += (ticks + 3) & ~3;
     }
-    else
-    {   /* Load next op and execute */
-        const uint8_t op = CPU_RB (gb->pc);
-        if (!gb->pcInc) /* Enable halt bug PC count or continue as normal */
-            gb->pcInc = 1;
-        else
-            gb->pc++;
-        gb_cpu_exec (gb, op);
-        LOG_CPU_STATE (gb, op);
+#ifdef USE_JIT
+    else if (gb_jit_exec (gb))
+    {   /* Native block ran, and its cycles are added below */
+        PROFILE_BREAK
     }
-
-    /* Update PPU if LCD is turned on */
-    if (gb->io[LCDControl].LCD_Enable)
-        gb_render (gb);
-
-    /* Update timers for every remaining m-cycle */
-#ifdef USE_TIMER_SIMPLE
-
-#ifndef FAST_TIMING
-    UPDATE_DIV (gb, gb->rt - (gb->readWrite << 2));
-    gb_update_timer_simple (gb, gb->rt - (gb->readWrite << 2));
-#else
-    UPDATE_DIV (gb, gb->rt);
-    gb_update_timer_simple (gb, gb->rt);
-#endif
-
-#else
-    int t = 0;
-    while (t++ < gb->rt)
-        gb_handle_timers (gb);
 #endif
+    else
+        gb_exec_next (gb);
 
     gb->clock_t += gb->rt;
+
+    /* PPU, timer and other timed events */
+    if (gb->clock_t >= gb->nextEvent)
+        gb_run_events (gb);
 }
 
 static inline void gb_frame (struct GB * gb)
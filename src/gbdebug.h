@@ -449,13 +449,10 @@ static uint8_t activeSpriteTiles[TOTAL_VRAM_TILES];
 /* Debug function for viewing all tiles in VRAM */
 
 static inline void debug_dump_tiles (
-    const struct GB * gb,
+    struct GB * gb,
     const uint16_t txWidth,
     uint8_t * pixelData)
 {
-    const uint8_t * data = gb->vram;
-    const uint8_t TILE_SIZE_BYTES = 16;
-
     const uint16_t NUM_ITEMS = TOTAL_VRAM_TILES;
     const uint8_t  NUM_COLS = 16;
     const uint8_t  TILE_WIDTH = 8;
@@ -473,6 +470,10 @@ static inline void debug_dump_tiles (
 		activeSpriteTiles[tileID + 1] = (gb->io[LCDControl].r & 4) >> 2;
 	}
 
+    /* Read the decoded tiles, bringing them up to date first */
+    if (gb->tilesDirty)
+        gb_tiles_update (gb);
+
     int t;
     for (t = 0; t < NUM_ITEMS; t++)
     {
@@ -488,8 +489,7 @@ static inline void debug_dump_tiles (
         {
 			if (y == 8) continue;
 
-            const uint8_t row1 = *(data + (y * 2));
-            const uint8_t row2 = *(data + (y * 2) + 1);
+            const uint8_t * row = gb->tiles[0][t][y];
             const uint16_t yOffset = y * txWidth;
 
             int x;
@@ -497,10 +497,7 @@ static inline void debug_dump_tiles (
             {
 				if (x == 8) continue;
 
-                uint8_t col1 = row1 >> (7 - x);
-                uint8_t col2 = row2 >> (7 - x);
-                
-                const uint8_t  colorID = 3 - ((col1 & 1) + ((col2 & 1) << 1));
+                const uint8_t  colorID = 3 - row[x];
                 const uint32_t idx = (tileYoffset + yOffset + tileXoffset + x) * 3;
 
                 pixelData[idx] = colorID * 0x55;
@@ -508,7 +505,6 @@ static inline void debug_dump_tiles (
                 pixelData[idx + 2] = colorID * 0x55;
             }
         }
-        data += TILE_SIZE_BYTES;
     }
 }
 
@@ -70,15 +70,20 @@ union regValues
     uint8_t r;
 };
 
-static const uint8_t apu_bitmasks[] = {
-    0x80, 0x3F, 0,    0xFF, 0xBF, /* NR10 ... */
-    0xFF, 0x3F, 0,    0xFF, 0xBF, /* NR20 ... */
-    0x7F, 0xFF, 0x9F, 0xFF, 0xBF, /* NR30 ... */
-    0xFF, 0xFF, 0,    0,    0xBF, /* NR40 ... */
-    0,    0,    0x70,             /* NR50 ... */
-    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0  /* Wave RAM */
-};
+/* Bits read as set, for each register from NR10 to the end of wave RAM */
+#define APU_BITMASKS(X)\
+    X(0x80) X(0x3F) X(0)    X(0xFF) X(0xBF) /* NR10 ... */\
+    X(0xFF) X(0x3F) X(0)    X(0xFF) X(0xBF) /* NR20 ... */\
+    X(0x7F) X(0xFF) X(0x9F) X(0xFF) X(0xBF) /* NR30 ... */\
+    X(0xFF) X(0xFF) X(0)    X(0)    X(0xBF) /* NR40 ... */\
+    X(0)    X(0)    X(0x70)                 /* NR50 ... */\
+    X(0xFF) X(0xFF) X(0xFF) X(0xFF) X(0xFF) X(0xFF) X(0xFF) X(0xFF) X(0xFF)\
+    X(0) X(0) X(0) X(0) X(0) X(0) X(0) X(0)\
+    X(0) X(0) X(0) X(0) X(0) X(0) X(0) X(0) /* Wave RAM */
+
+#define APU_BITMASK(mask)  mask,
+
+static const uint8_t apu_bitmasks[] = { APU_BITMASKS (APU_BITMASK) };
 
 /* Related IO registers */
 
@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include "jit.h"
+
+#ifdef USE_JIT
+
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "opcycles.h"
+
+/*
+ *  Recompiles the leading run of register, load/store and DAA instructions
+ *  of a cached block into x86-64 code, up to a closing JR. Game Boy
+ *  registers are kept in r8b-r15b while the block runs:
+ *
+ *      A  B  C  D  E  H  L  F
+ *      r8 r9 r10 r11 r12 r13 r14 r15
+ *
+ *  Flags come from LAHF and a table mapping x86 ZF/AF/CF to Z/H/C.
+ *  Loads and stores go through readPage and writePage, as the first step
+ *  of gb_mem_read and gb_mem_write does. An address without a direct page
+ *  returns to the interpreter at that instruction, and the native code
+ *  returns the number of instructions it ran. Stack, CB and other control
+ *  flow instructions end the native run, and the interpreter does the
+ *  timer and PPU updates.
+ */
+
+/* x86 flags from LAHF (SF ZF - AF - PF - CF) mapped to Z - H C */
+#define JIT_FLAG(f)     ((((f) & 0x40) << 1) | (((f) & 0x10) << 1) | (((f) & 1) << 4))
+#define JIT_FLAGS4(f)   JIT_FLAG(f), JIT_FLAG(f + 1), JIT_FLAG(f + 2), JIT_FLAG(f + 3)
+#define JIT_FLAGS16(f)  JIT_FLAGS4(f), JIT_FLAGS4(f + 4), JIT_FLAGS4(f + 8), JIT_FLAGS4(f + 12)
+#define JIT_FLAGS64(f)  JIT_FLAGS16(f), JIT_FLAGS16(f + 16), JIT_FLAGS16(f + 32), JIT_FLAGS16(f + 48)
+
+static const uint8_t flagTable[256] = {
+    JIT_FLAGS64(0), JIT_FLAGS64(64), JIT_FLAGS64(128), JIT_FLAGS64(192)
+};
+
+/* DAA results, as F << 8 | A, by the N, H and C flags and A */
+static uint16_t daaTable[0x800];
+
+static void jit_daa_init()
+{
+    uint16_t i;
+    for (i = 0; i < 0x800; i++)
+    {
+        const uint8_t n = (i >> 10) & 1, h = (i >> 9) & 1;
+        uint8_t c = (i >> 8) & 1;
+        int16_t a = i & 0xFF;
+
+        if (n) {
+            if (h) a = (a - 0x06) & 0xFF;
+            if (c) a -= 0x60;
+        } else {
+            if (h || (a & 0x0F) > 9) a += 0x06;
+            if (c || a > 0x9F) a += 0x60;
+        }
+        if ((a & 0x100) == 0x100)
+            c = 1;
+        daaTable[i] = ((((a & 0xFF) == 0) << 7 | (n << 6) | (c << 4)) << 8) | (a & 0xFF);
+    }
+}
+
+/* Host register for each 3-bit register index (B C D E H L - A) */
+static const uint8_t hostReg[8] = { 9, 10, 11, 12, 13, 14, 0, 8 };
+
+#define HOST_A   8
+#define HOST_F   15
+
+#define OFS(field)  ((int32_t) offsetof(struct GB, field))
+
+/* Register memory offsets in the same order as hostReg */
+static int32_t regOffset(const uint8_t r)
+{
+    switch (r)
+    {
+        case 0: return OFS(bc) + 1;
+        case 1: return OFS(bc);
+        case 2: return OFS(de) + 1;
+        case 3: return OFS(de);
+        case 4: return OFS(hl) + 1;
+        case 5: return OFS(hl);
+        case 7: return OFS(af) + 1;
+    }
+    return OFS(flags);
+}
+
+/* Code emitters */
+
+#define EMIT(x)  (*p++ = (uint8_t)(x))
+
+static uint8_t * emit_32(uint8_t * p, const uint32_t v)
+{
+    EMIT(v); EMIT(v >> 8); EMIT(v >> 16); EMIT(v >> 24);
+    return p;
+}
+
+static uint8_t * emit_64(uint8_t * p, const uint64_t v)
+{
+    p = emit_32(p, (uint32_t) v);
+    return emit_32(p, (uint32_t)(v >> 32));
+}
+
+/* mov reg8, [rdi + ofs] | mov [rdi + ofs], reg8 */
+static uint8_t * emit_load(uint8_t * p, const uint8_t host, const int32_t ofs, const uint8_t store)
+{
+    EMIT(0x44); EMIT(store ? 0x88 : 0x8A); EMIT(0x87 | ((host & 7) << 3));
+    return emit_32(p, ofs);
+}
+
+/* op dst8, src8 for the r/m8,r8 ALU forms */
+static uint8_t * emit_alu_rr(uint8_t * p, const uint8_t op, const uint8_t dst, const uint8_t src)
+{
+    EMIT(0x45); EMIT(op); EMIT(0xC0 | ((src & 7) << 3) | (dst & 7));
+    return p;
+}
+
+/* op dst8, imm8 for the 0x80 /digit group */
+static uint8_t * emit_alu_ri(uint8_t * p, const uint8_t digit, const uint8_t dst, const uint8_t imm)
+{
+    EMIT(0x41); EMIT(0x80); EMIT(0xC0 | (digit << 3) | (dst & 7)); EMIT(imm);
+    return p;
+}
+
+/* Convert x86 flags to Z/H/C in AL: lahf; movzx eax, ah; mov al, [rsi + rax] */
+static uint8_t * emit_flags(uint8_t * p)
+{
+    EMIT(0x9F);
+    EMIT(0x0F); EMIT(0xB6); EMIT(0xC4);
+    EMIT(0x8A); EMIT(0x04); EMIT(0x06);
+    return p;
+}
+
+#define MOV_F_AL  EMIT(0x41); EMIT(0x88); EMIT(0xC7); /* mov r15b, al */
+#define OR_F_AL   EMIT(0x41); EMIT(0x08); EMIT(0xC7); /* or  r15b, al */
+#define BT_F_C    EMIT(0x41); EMIT(0x0F); EMIT(0xBA); EMIT(0xE7); EMIT(0x04); /* bt r15d, 4 */
+
+/* x86 opcodes and 0x80 group digits for ADD ADC SUB SBC AND XOR OR CP */
+static const uint8_t aluOp[8]    = { 0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38 };
+static const uint8_t aluDigit[8] = { 0, 2, 5, 3, 4, 6, 1, 7 };
+
+/* Set F after an ALU operation, given by its 3-bit index */
+static uint8_t * emit_alu_flags(uint8_t * p, const uint8_t alu)
+{
+    p = emit_flags(p);
+    switch (alu)
+    {
+        case 4: /* AND */
+            EMIT(0x24); EMIT(0x80);
+            EMIT(0x0C); EMIT(0x20);
+            break;
+        case 5: /* XOR */
+        case 6: /* OR  */
+            EMIT(0x24); EMIT(0x80);
+            break;
+        case 2: /* SUB */
+        case 3: /* SBC */
+        case 7: /* CP  */
+            EMIT(0x0C); EMIT(0x40);
+            break;
+    }
+    MOV_F_AL
+    return p;
+}
+
+/* Address from a register pair into ecx: movzx ecx, hi; shl ecx, 8; mov cl, lo */
+static uint8_t * emit_addr(uint8_t * p, const uint8_t hi, const uint8_t lo)
+{
+    EMIT(0x41); EMIT(0x0F); EMIT(0xB6); EMIT(0xC8 | (hi & 7));
+    EMIT(0xC1); EMIT(0xE1); EMIT(0x08);
+    EMIT(0x44); EMIT(0x88); EMIT(0xC1 | ((lo & 7) << 3));
+    return p;
+}
+
+/* Look up the page of the address in ecx, from readPage or writePage,
+   into rdx, leaving the offset in ecx. An unmapped page returns the
+   number of instructions done, through a jump to be patched at *exit */
+static uint8_t * emit_page(uint8_t * p, const int32_t pages, const uint8_t done, uint8_t ** exit)
+{
+    EMIT(0x0F); EMIT(0xB6); EMIT(0xC5);              /* movzx eax, ch                 */
+    EMIT(0x48); EMIT(0x8B); EMIT(0x94); EMIT(0xC7);  /* mov rdx, [rdi + rax * 8 + ofs] */
+    p = emit_32(p, pages);
+    EMIT(0x48); EMIT(0x85); EMIT(0xD2);              /* test rdx, rdx                 */
+    EMIT(0x75); EMIT(0x0A);                          /* jnz mapped                    */
+    EMIT(0xB8); p = emit_32(p, done);                /* mov eax, done                 */
+    EMIT(0xE9); *exit = p; p = emit_32(p, 0);        /* jmp exit                      */
+    EMIT(0x0F); EMIT(0xB6); EMIT(0xC9);              /* mapped: movzx ecx, cl         */
+    return p;
+}
+
+/* mov reg8, [rdx + rcx] | mov [rdx + rcx], reg8 */
+static uint8_t * emit_access(uint8_t * p, const uint8_t host, const uint8_t store)
+{
+    EMIT(0x44); EMIT(store ? 0x88 : 0x8A); EMIT(0x04 | ((host & 7) << 3)); EMIT(0x0A);
+    return p;
+}
+
+/* Whether an opcode can be recompiled. JR ends a block, so it's always
+   the last instruction of a native run */
+
+static uint8_t jit_supported(const uint8_t op)
+{
+    if (op == 0x76 || op == 0x34 || op == 0x35)
+        return 0;
+    if (op >= 0x40 && op < 0xC0) /* LD r,r, ALU A,r and their (HL) forms */
+        return 1;
+
+    switch (op)
+    {
+        case 0x00: /* NOP */
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+        case 0x03: case 0x13: case 0x23: case 0x33:
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+        case 0x02: case 0x12: case 0x22: case 0x32: /* LD (rr),A */
+        case 0x0A: case 0x1A: case 0x2A: case 0x3A: /* LD A,(rr) */
+        case 0xEA: case 0xFA:                       /* LD (nn),A, LD A,(nn) */
+        case 0x27: case 0x2F: case 0x37: case 0x3F:
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether an opcode reads or writes memory */
+
+static uint8_t jit_memory(const uint8_t op)
+{
+    if (op >= 0x40 && op < 0xC0)
+        return op != 0x76 && ((op & 7) == 6 || (op >= 0x70 && op < 0x78));
+    return op == 0x36 || op == 0xEA || op == 0xFA || (op < 0x40 && (op & 7) == 2);
+}
+
+static uint8_t * emit_memory_op(uint8_t * p, const uint8_t * bytes, const uint8_t done,
+    uint8_t ** exit)
+{
+    const uint8_t op = bytes[0];
+    const uint8_t dst = (op >> 3) & 7;
+    const uint8_t store = (op >= 0x70 && op < 0x78) || op == 0x36 || op == 0xEA ||
+        (op < 0x40 && (op & 0xF) == 0x02);
+
+    if (op == 0xEA || op == 0xFA)
+    {
+        EMIT(0xB9); p = emit_32(p, bytes[1] | (bytes[2] << 8)); /* mov ecx, nn */
+    }
+    else if (op < 0x20) /* (BC), (DE) */
+        p = emit_addr(p, hostReg[(op >> 4) * 2], hostReg[(op >> 4) * 2 + 1]);
+    else
+        p = emit_addr(p, hostReg[4], hostReg[5]);
+
+    p = emit_page(p, store ? OFS(writePage) : OFS(readPage), done, exit);
+
+    if (op == 0x36) /* LD (HL),n: mov byte [rdx + rcx], n */
+    {
+        EMIT(0xC6); EMIT(0x04); EMIT(0x0A); EMIT(bytes[1]);
+    }
+    else if (op >= 0x70 && op < 0x78)
+        p = emit_access(p, hostReg[op & 7], 1);
+    else if (op >= 0x80 && op < 0xC0) /* ALU A,(HL), through al */
+    {
+        EMIT(0x8A); EMIT(0x04); EMIT(0x0A);
+        if (dst == 1 || dst == 3)
+        {
+            BT_F_C
+        }
+        EMIT(0x41); EMIT(aluOp[dst]); EMIT(0xC0 | (HOST_A & 7));
+        p = emit_alu_flags(p, dst);
+    }
+    else
+        p = emit_access(p, (op >= 0x40 && op < 0x80) ? hostReg[dst] : HOST_A, store);
+
+    /* HL+ and HL- */
+    if (op == 0x22 || op == 0x2A || op == 0x32 || op == 0x3A)
+    {
+        p = emit_alu_ri(p, (op & 0x10) ? 5 : 0, hostReg[5], 1);
+        p = emit_alu_ri(p, (op & 0x10) ? 3 : 2, hostReg[4], 0);
+    }
+    return p;
+}
+
+static uint8_t * emit_op(uint8_t * p, const uint8_t * bytes, const uint8_t done, uint8_t ** exit)
+{
+    const uint8_t op = bytes[0];
+    const uint8_t dst = (op >> 3) & 7;
+
+    if (jit_memory(op))
+        return emit_memory_op(p, bytes, done, exit);
+
+    if (op >= 0x40 && op < 0x80) /* LD r,r */
+    {
+        if (dst != (op & 7))
+            p = emit_alu_rr(p, 0x88, hostReg[dst], hostReg[op & 7]);
+        return p;
+    }
+    if (op >= 0x80 && op < 0xC0) /* ALU A,r */
+    {
+        if (dst == 1 || dst == 3)
+        {
+            BT_F_C
+        }
+        p = emit_alu_rr(p, aluOp[dst], HOST_A, hostReg[op & 7]);
+        return emit_alu_flags(p, dst);
+    }
+    if (op >= 0xC0) /* ALU A,n */
+    {
+        if (dst == 1 || dst == 3)
+        {
+            BT_F_C
+        }
+        p = emit_alu_ri(p, aluDigit[dst], HOST_A, bytes[1]);
+        return emit_alu_flags(p, dst);
+    }
+
+    switch (op & 7)
+    {
+        case 6: /* LD r,n */
+            EMIT(0x41); EMIT(0xB0 | (hostReg[dst] & 7)); EMIT(bytes[1]);
+            break;
+        case 4: /* INC r, DEC r */
+        case 5:
+            EMIT(0x41); EMIT(0xFE); EMIT(0xC0 | ((op & 1) << 3) | (hostReg[dst] & 7));
+            p = emit_flags(p);
+            EMIT(0x24); EMIT(0xA0);
+            p = emit_alu_ri(p, 4, HOST_F, 0x10);
+            if (op & 1)
+            {
+                EMIT(0x0C); EMIT(0x40);
+            }
+            OR_F_AL
+            break;
+        case 3: /* INC rr, DEC rr */
+            if (op == 0x33 || op == 0x3B)
+            {
+                EMIT(0x66); EMIT(0xFF); EMIT((op & 8) ? 0x8F : 0x87);
+                p = emit_32(p, OFS(sp));
+            }
+            else
+            {
+                const uint8_t hi = hostReg[(op >> 3) & 6], lo = hostReg[((op >> 3) & 6) + 1];
+                p = emit_alu_ri(p, (op & 8) ? 5 : 0, lo, 1);
+                p = emit_alu_ri(p, (op & 8) ? 3 : 2, hi, 0);
+            }
+            break;
+        case 7:
+            if (op == 0x27) /* DAA, from daaTable by N, H, C and A */
+            {
+                EMIT(0x41); EMIT(0x0F); EMIT(0xB6); EMIT(0xC7); /* movzx eax, r15b  */
+                EMIT(0xC1); EMIT(0xE8); EMIT(0x04);             /* shr eax, 4       */
+                EMIT(0x83); EMIT(0xE0); EMIT(0x07);             /* and eax, 7       */
+                EMIT(0xC1); EMIT(0xE0); EMIT(0x08);             /* shl eax, 8       */
+                EMIT(0x44); EMIT(0x88); EMIT(0xC0);             /* mov al, r8b      */
+                EMIT(0x48); EMIT(0xBA);                         /* mov rdx, daaTable */
+                p = emit_64(p, (uint64_t)(uintptr_t) daaTable);
+                EMIT(0x0F); EMIT(0xB7); EMIT(0x04); EMIT(0x42); /* movzx eax, word [rdx + rax * 2] */
+                EMIT(0x41); EMIT(0x88); EMIT(0xC0);             /* mov r8b, al      */
+                EMIT(0xC1); EMIT(0xE8); EMIT(0x08);             /* shr eax, 8       */
+                MOV_F_AL
+            }
+            else if (op == 0x2F) /* CPL */
+            {
+                EMIT(0x41); EMIT(0xF6); EMIT(0xD0 | (HOST_A & 7));
+                p = emit_alu_ri(p, 1, HOST_F, 0x60);
+            }
+            else /* SCF, CCF */
+            {
+                p = emit_alu_ri(p, (op == 0x37) ? 1 : 6, HOST_F, 0x10);
+                p = emit_alu_ri(p, 4, HOST_F, 0x9F);
+            }
+            break;
+    }
+    return p;
+}
+
+/* Make the arena pages spanning the given range writable, or executable
+   again once written. Code is never both at once */
+
+static uint8_t jit_protect(uint8_t * const arena, const uint32_t from, const uint32_t to,
+    const uint8_t write)
+{
+    const uint32_t page = (uint32_t) sysconf(_SC_PAGESIZE);
+    const uint32_t first = from & ~(page - 1);
+
+    return !mprotect(arena + first, ((to + page - 1) & ~(page - 1)) - first,
+        write ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+}
+
+void jit_compile(struct GB * gb, struct gb_block * b)
+{
+    static uint8_t daaReady;
+    uint8_t i, ops = 0, len = 0, cycles = 0;
+    uint8_t * start, * p;
+    uint8_t * exits[BLOCK_OPS_MAX];
+
+    while (ops < b->count && jit_supported(b->ops[ops].bytes[0]))
+    {
+        const uint8_t op = b->ops[ops++].bytes[0];
+        len    += opLength[op];
+        cycles += b->ops[ops - 1].cycles;
+    }
+    /* Single instructions aren't worth the call */
+    if (ops < 2)
+        return;
+
+    if (!daaReady)
+    {
+        jit_daa_init();
+        daaReady = 1;
+    }
+    if (!gb->jitArena)
+    {
+        gb->jitArena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (gb->jitArena == MAP_FAILED)
+        {
+            gb->jitArena = NULL;
+            return;
+        }
+        gb->jitUsed = 0;
+    }
+    if (gb->jitUsed + JIT_BLOCK_BYTES > JIT_ARENA_SIZE)
+    {
+        gb->jitUsed = 0;
+        ++gb->jitEpoch;
+    }
+    if (!jit_protect(gb->jitArena, gb->jitUsed, gb->jitUsed + JIT_BLOCK_BYTES, 1))
+        return;
+
+    start = gb->jitArena + gb->jitUsed;
+    p = start;
+
+    /* Save callee-saved registers, load the flag table and registers */
+    EMIT(0x41); EMIT(0x54); EMIT(0x41); EMIT(0x55);
+    EMIT(0x41); EMIT(0x56); EMIT(0x41); EMIT(0x57);
+    EMIT(0x48); EMIT(0xBE);
+    p = emit_64(p, (uint64_t)(uintptr_t) flagTable);
+    for (i = 0; i < 8; i++)
+        p = emit_load(p, (i == 6) ? HOST_F : hostReg[i], regOffset(i), 0);
+
+    for (i = 0; i < ops; i++)
+    {
+        exits[i] = NULL;
+        p = emit_op(p, b->ops[i].bytes, i, &exits[i]);
+    }
+
+    /* Return the instruction count, with JIT_TAKEN if the final JR branches */
+    EMIT(0xB8); p = emit_32(p, ops);                 /* mov eax, ops */
+    {
+        const uint8_t op = b->ops[ops - 1].bytes[0];
+        if (op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38)
+        {
+            const uint8_t cond = (op >> 3) & 3;
+            EMIT(0x41); EMIT(0xF6); EMIT(0xC7);      /* test r15b, Z or C */
+            EMIT((cond & 2) ? 0x10 : 0x80);
+            EMIT((cond & 1) ? 0x74 : 0x75); EMIT(0x05); /* jz/jnz past the or */
+        }
+        if ((op & 0xE7) == 0x20 || op == 0x18)
+        {
+            EMIT(0x0D); p = emit_32(p, JIT_TAKEN);   /* or eax, JIT_TAKEN */
+        }
+    }
+
+    /* Unmapped pages return here, with the instructions done so far */
+    for (i = 0; i < ops; i++)
+    {
+        if (exits[i])
+            emit_32(exits[i], (uint32_t)(p - (exits[i] + 4)));
+    }
+
+    /* Write back registers and return */
+    for (i = 0; i < 8; i++)
+        p = emit_load(p, (i == 6) ? HOST_F : hostReg[i], regOffset(i), 1);
+    EMIT(0x41); EMIT(0x5F); EMIT(0x41); EMIT(0x5E);
+    EMIT(0x41); EMIT(0x5D); EMIT(0x41); EMIT(0x5C);
+    EMIT(0xC3);
+
+    if (!jit_protect(gb->jitArena, gb->jitUsed, gb->jitUsed + JIT_BLOCK_BYTES, 0))
+        return;
+    gb->jitUsed += (p - start + 15) & ~15;
+
+    b->native = (gb_native_fn) start;
+    b->nativeOps = ops;
+    b->nativeLen = len;
+    b->nativeCycles = cycles;
+    b->epoch = gb->jitEpoch;
+}
+
+void jit_free(struct GB * gb)
+{
+    if (gb->jitArena)
+        munmap(gb->jitArena, JIT_ARENA_SIZE);
+    gb->jitArena = NULL;
+    ++gb->jitEpoch; /* Blocks compiled so far are gone */
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "gb.h"
+
+#ifdef USE_JIT
+
+#define JIT_HOT_COUNT    32        /* Block entries before it's compiled  */
+#define JIT_ARENA_SIZE   0x100000  /* Executable memory for native blocks */
+#define JIT_BLOCK_BYTES  0x800     /* Largest native block that's emitted */
+
+/* Native code returns the number of instructions it ran, which is fewer
+   than the block's nativeOps if one reached an unmapped page, and sets
+   JIT_TAKEN when it ends with a JR that branches */
+#define JIT_TAKEN        0x100
+
+/* Native code is only valid while its epoch matches the instance's.
+   The epoch advances whenever its arena is full and gets reused. */
+
+void jit_compile (struct GB *, struct gb_block *);
+void jit_free    (struct GB *);
+
+#endif
+#endif
@@ -0,0 +1,19 @@
+/* Fused opcode pairs, generated by the opcode profiler
+   (make profile) from 89798638 executed ops */
+
+FUSE_2 (0x05, 0x20)  /*  3.50% */
+FUSE_2 (0x0D, 0x20)  /*  0.55% */
+FUSE_2 (0x3D, 0x20)  /*  0.55% */
+
+/* Most frequent straight-line triples. CB prefixed ops are
+   0x100 + the CB opcode.
+
+   0x0F0 0x0FE 0x020  20.45%
+   0x081 0x027 0x04F   3.50%
+   0x027 0x04F 0x012   3.49%
+   0x02A 0x081 0x027   3.49%
+   0x013 0x005 0x020   3.49%
+   0x012 0x013 0x005   3.48%
+   0x04F 0x012 0x013   3.48%
+   0x02C 0x02C 0x02C   1.09%
+*/
\ No newline at end of file
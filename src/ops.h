@@ -28,8 +28,16 @@
 
 #define CPU_RB(A)     gb_mem_read (gb, A)
 #define CPU_WB(A,X)   gb_mem_write (gb, A, (X))
-#define CPU_RB_PC     gb_mem_read (gb, gb->pc)
 #define CPU_RW(A)     ( CPU_RB (A) +  (CPU_RB (A + 1) << 8) )
+
+/* Instruction stream reads, which may come from the block cache */
+#ifdef USE_BLOCK_CACHE
+#define CPU_FETCH(A)  gb_fetch (gb, A)
+#else
+#define CPU_FETCH(A)  gb_mem_read (gb, A)
+#endif
+#define CPU_RB_PC     CPU_FETCH (gb->pc)
+#define CPU_RW_PC     ( CPU_FETCH (gb->pc) + (CPU_FETCH (gb->pc + 1) << 8) )
 #define CPU_WW(A,X)   { CPU_WB (A, X); CPU_WB (A + 1, (X >> 8)); }
 
 /** Choose between operations based on position **/
@@ -96,6 +104,84 @@
     case op_ + 0x20: _r16 (op_ + 0x20, REG_H, REG_L)       break;\
     case op_ + 0x30: _r16 (op_ + 0x30, REG_A, (gb->flags)) break;\
 
+/** Handler labels for computed goto dispatch (USE_COMPUTED_GOTO) **/
+
+#define OP_END         goto op_done;
+#define CB_END         goto cb_done;
+
+#define OP_ROW(h)\
+    &&op_##h##0, &&op_##h##1, &&op_##h##2, &&op_##h##3,\
+    &&op_##h##4, &&op_##h##5, &&op_##h##6, &&op_##h##7,\
+    &&op_##h##8, &&op_##h##9, &&op_##h##A, &&op_##h##B,\
+    &&op_##h##C, &&op_##h##D, &&op_##h##E, &&op_##h##F,\
+
+#define LBL_r8_(h, d0, d1, d2, d3, d4, d5, d7, name, R)\
+    op_##h##d0: { name ##_r8(R, REG_B); } OP_END\
+    op_##h##d1: { name ##_r8(R, REG_C); } OP_END\
+    op_##h##d2: { name ##_r8(R, REG_D); } OP_END\
+    op_##h##d3: { name ##_r8(R, REG_E); } OP_END\
+    op_##h##d4: { name ##_r8(R, REG_H); } OP_END\
+    op_##h##d5: { name ##_r8(R, REG_L); } OP_END\
+    op_##h##d7: { name ##_r8(R, REG_A); } OP_END\
+
+#define LBL_r8_lo(h, name, R)  LBL_r8_(h, 0, 1, 2, 3, 4, 5, 7, name, R)
+#define LBL_r8_hi(h, name, R)  LBL_r8_(h, 8, 9, A, B, C, D, F, name, R)
+
+#define LBL_r8_hl_lo(h, name, R)\
+    LBL_r8_lo(h, name, R)\
+    op_##h##6: { name ##_r8(R, CPU_RB(REG_HL)); } OP_END\
+
+#define LBL_r8_hl_hi(h, name, R)\
+    LBL_r8_hi(h, name, R)\
+    op_##h##E: { name ##_r8(R, CPU_RB(REG_HL)); } OP_END\
+
+#define LBL_r8_g(d, e, name, R)\
+    op_0##d: { name ##_r8(REG_B, R); } OP_END\
+    op_0##e: { name ##_r8(REG_C, R); } OP_END\
+    op_1##d: { name ##_r8(REG_D, R); } OP_END\
+    op_1##e: { name ##_r8(REG_E, R); } OP_END\
+    op_2##d: { name ##_r8(REG_H, R); } OP_END\
+    op_2##e: { name ##_r8(REG_L, R); } OP_END\
+    op_3##d: { name ##_hl(REG_A, R); } OP_END\
+    op_3##e: { name ##_r8(REG_A, R); } OP_END\
+
+#define LBL_r16_g(d, _r16)\
+    op_0##d: { _r16 (REG_BC) } OP_END\
+    op_1##d: { _r16 (REG_DE) } OP_END\
+    op_2##d: { _r16 (REG_HL) } OP_END\
+
+#define LBL_r16_g1(d, _r16)\
+    LBL_r16_g(d, _r16)\
+    op_3##d: { _r16 (gb->sp) } OP_END\
+
+#define LBL_r16_g2(d, _r16)\
+    LBL_r16_g(d, _r16)\
+    op_3##d: { _r16 (REG_HL) } OP_END\
+
+#define LBL_r16_g3(d, _r16)\
+    op_C##d: { _r16 (0xC##d, REG_B, REG_C) }       OP_END\
+    op_D##d: { _r16 (0xD##d, REG_D, REG_E) }       OP_END\
+    op_E##d: { _r16 (0xE##d, REG_H, REG_L) }       OP_END\
+    op_F##d: { _r16 (0xF##d, REG_A, (gb->flags)) } OP_END\
+
+#define CB_ROW(name)\
+    &&cb_##name##_b, &&cb_##name##_c, &&cb_##name##_d, &&cb_##name##_e,\
+    &&cb_##name##_h, &&cb_##name##_l, &&cb_##name##_hl, &&cb_##name##_a,\
+
+#define CB_ROW_8(name)\
+    CB_ROW(name) CB_ROW(name) CB_ROW(name) CB_ROW(name)\
+    CB_ROW(name) CB_ROW(name) CB_ROW(name) CB_ROW(name)\
+
+#define LBL_CB(name)\
+    cb_##name##_b:  { name (REG_B) } CB_END\
+    cb_##name##_c:  { name (REG_C) } CB_END\
+    cb_##name##_d:  { name (REG_D) } CB_END\
+    cb_##name##_e:  { name (REG_E) } CB_END\
+    cb_##name##_h:  { name (REG_H) } CB_END\
+    cb_##name##_l:  { name (REG_L) } CB_END\
+    cb_##name##_hl: { hl = CPU_RB(REG_HL); name (hl) } CB_END\
+    cb_##name##_a:  { name (REG_A) } CB_END\
+
 /** 8-bit load instructions **/
 
 #define LD_r8(dest, src)     OP(LD_r8) dest = src;
@@ -113,8 +199,8 @@
 #define LDrm_r8(r8, _)   OP(LD m)  r8 = CPU_RB_PC; ++gb->pc;
 #define LDrm_hl(r8, _)   OP(LD m)  CPU_WB (REG_HL, CPU_RB_PC); ++gb->pc;
 
-#define LDAmm   OP(LDAmm)   REG_A = CPU_RB (CPU_RW (gb->pc)); ++gb->pc; ++gb->pc;
-#define LDmmA   OP(LDmmA)   CPU_WB (CPU_RW (gb->pc), REG_A);  ++gb->pc; ++gb->pc;
+#define LDAmm   OP(LDAmm)   REG_A = CPU_RB (CPU_RW_PC); ++gb->pc; ++gb->pc;
+#define LDmmA   OP(LDmmA)   CPU_WB (CPU_RW_PC, REG_A);  ++gb->pc; ++gb->pc;
 
 #define LDHmA   OP(LDH mA)  CPU_WB (0xFF00 + CPU_RB_PC, REG_A); ++gb->pc;
 #define LDHCA   OP(LDH CA)  CPU_WB (0xFF00 + REG_C, REG_A);
@@ -129,17 +215,35 @@
 
 /** 16-bit load instructions **/
 
-#define LDmSP           OP(LDmSP)   { gb->nn = CPU_RW (gb->pc); CPU_WW (gb->nn, gb->sp); ++gb->pc; ++gb->pc; }
-#define LDSP            OP(LDSP)    gb->sp = CPU_RW (gb->pc); ++gb->pc; ++gb->pc;
+#define LDmSP           OP(LDmSP)   { gb->nn = CPU_RW_PC; CPU_WW (gb->nn, gb->sp); ++gb->pc; ++gb->pc; }
+#define LDSP            OP(LDSP)    gb->sp = CPU_RW_PC; ++gb->pc; ++gb->pc;
 #define LDSPHL          OP(LDSPHL)  gb->sp = REG_HL; INC_MCYCLE;
-#define LDrr(r16)       OP(LDrr)    r16 = CPU_RW (gb->pc); ++gb->pc; ++gb->pc;
+#define LDrr(r16)       OP(LDrr)    r16 = CPU_RW_PC; ++gb->pc; ++gb->pc;
 
 #define PUSH_(X, Y)     gb->sp--; INC_MCYCLE; CPU_WB (gb->sp, X); gb->sp--; CPU_WB (gb->sp, Y);
 
-#define PUSHrr(op_, R16_1, R16_2)  OP(PUSHrr) PUSH_(R16_1, R16_2);
-#define POPrr(op_, R16_1, R16_2)   OP(POPrr)\
+#define PUSHrr(op_, R16_1, R16_2)  OP(PUSHrr) if (op_ == 0xF5) { FLAGS_SYNC } PUSH_(R16_1, R16_2);
+#define POPrr(op_, R16_1, R16_2)   OP(POPrr) if (op_ == 0xF1) { FLAGS_DONE }\
     R16_2 = CPU_RB (gb->sp++) & ((op_ == 0xF1) ? 0xF0 : 0xFF); R16_1 = CPU_RB (gb->sp++);
 
+/* Flag reading helpers. With lazy flags, the last ALU op only records
+   its operands and result, and F is worked out when it's read. Ops that
+   keep some of the old flags sync F first, and ops that set all of them
+   mark it as up to date. */
+
+#ifdef USE_LAZY_FLAGS
+#define FLAG_C           gb_flag_c (gb)
+#define FLAG_Z           gb_flag_z (gb)
+#define FLAGS_SYNC       gb_flags_sync (gb);
+#define FLAGS_DONE       gb->lazyOp = LAZY_NONE;
+#define FLAGS_LAZY(op_, x, res)  gb->lazyRes = (res); gb->lazyX = (x); gb->lazyOp = op_;
+#else
+#define FLAG_C           gb->f_c
+#define FLAG_Z           gb->f_z
+#define FLAGS_SYNC
+#define FLAGS_DONE
+#endif
+
 /* Flag setting helpers */
 
 #define SET_FLAG_Z(X)    gb->f_z = ((X) == 0)
@@ -147,14 +251,21 @@
 #define SET_FLAG_H(X)    gb->f_h = (X)
 #define SET_FLAG_C(X)    gb->f_c = (X)
 
+#define FLAGS_RESET      FLAGS_DONE gb->flags = 0;
+
 #define SET_FLAGS(mask, z,n,h,c)\
+    if (mask) { FLAGS_SYNC } else { FLAGS_DONE }\
     gb->flags = (gb->flags & mask) | ((!z << 7) | (n << 6) | (h << 5) | (c << 4))
 
 /** 8-bit arithmetic/logic instructions **/
 
     /* Add function templates */
+#ifdef USE_LAZY_FLAGS
+    #define FLAGS_ALU_(X, N)  FLAGS_LAZY ((N) ? LAZY_SUB : LAZY_ADD, REG_A ^ X, gb->nn)
+#else
     #define FLAGS_ALU_(X, N)  SET_FLAGS (0,\
         (gb->nn & 0xFF), N, (((REG_A ^ X ^ gb->nn) & 0x10) > 0), (gb->nn >= 0x100))
+#endif
 
     #define ADC_A_(X, C)   const uint8_t val = X; gb->nn = REG_A + val + C; FLAGS_ALU_(val, 0); REG_A = gb->nn & 0xFF;
     #define SBC_A_(X, C)   const uint8_t val = X; gb->nn = REG_A - val - C; FLAGS_ALU_(val, 1); REG_A = gb->nn & 0xFF;
@@ -162,41 +273,53 @@
     /* Add and subtract */
 
 #define ADD_r8(_, r8)  OP(ADD)  { ADC_A_(r8, 0) }
-#define ADC_r8(_, r8)  OP(ADC)  { ADC_A_(r8, gb->f_c) }
+#define ADC_r8(_, r8)  OP(ADC)  { ADC_A_(r8, FLAG_C) }
 
 #define SUB_r8(_, r8)  OP(SUB)  { SBC_A_(r8, 0) }
-#define SBC_r8(_, r8)  OP(SBC)  { SBC_A_(r8, gb->f_c) }
+#define SBC_r8(_, r8)  OP(SBC)  { SBC_A_(r8, FLAG_C) }
 
 /* Bitwise logic */
 
     /* Bitwise logic templates */
+#ifdef USE_LAZY_FLAGS
+    #define FLAGS_AND_(X)    REG_A &= X; FLAGS_LAZY (LAZY_AND,   0, REG_A)
+    #define FLAGS_XOR_(X)    REG_A ^= X; FLAGS_LAZY (LAZY_LOGIC, 0, REG_A)
+    #define FLAGS_OR_(X)     REG_A |= X; FLAGS_LAZY (LAZY_LOGIC, 0, REG_A)
+    #define FLAGS_CP         FLAGS_LAZY (LAZY_SUB, REG_A ^ val, (uint16_t)(REG_A - val))
+#else
     #define FLAGS_AND_(X)    gb->flags = 0; SET_FLAG_Z (REG_A &= X); SET_FLAG_H (1);
     #define FLAGS_XOR_(X)    gb->flags = 0; SET_FLAG_Z (REG_A ^= X);
     #define FLAGS_OR_(X)     gb->flags = 0; SET_FLAG_Z (REG_A |= X);
     #define FLAGS_CP         SET_FLAGS (0, tmp, 1, ((tmp & 0xF) > (REG_A & 0xF)), (tmp > REG_A));
+#endif
 
 #define AND_r8(_, r8)   OP(AND)  FLAGS_AND_(r8);
 #define XOR_r8(_, r8)   OP(XOR)  FLAGS_XOR_(r8);
 #define OR_r8(_, r8)    OP(OR)   FLAGS_OR_(r8);
-#define CP_r8(_, r8)    OP(CP)   tmp -= r8; FLAGS_CP;
+#define CP_r8(_, r8)    OP(CP)   { const uint8_t val = r8; tmp -= val; FLAGS_CP }
 
 #define ADDm        OP(ADDm)     { uint8_t m = CPU_RB_PC; ++gb->pc; ADC_A_(m, 0); }
-#define ADCm        OP(ADCm)     { uint8_t m = CPU_RB_PC; ++gb->pc; ADC_A_(m, gb->f_c); }
+#define ADCm        OP(ADCm)     { uint8_t m = CPU_RB_PC; ++gb->pc; ADC_A_(m, FLAG_C); }
 
 #define SUBm        OP(SUBm)     { uint8_t m = CPU_RB_PC; ++gb->pc; SBC_A_(m, 0); }
-#define SBCm        OP(SBCm)     { uint8_t m = CPU_RB_PC; ++gb->pc; SBC_A_(m, gb->f_c); }
+#define SBCm        OP(SBCm)     { uint8_t m = CPU_RB_PC; ++gb->pc; SBC_A_(m, FLAG_C); }
 
 #define ANDm        OP(ANDm)     FLAGS_AND_(CPU_RB_PC); ++gb->pc;
 #define XORm        OP(XORm)     FLAGS_XOR_(CPU_RB_PC); ++gb->pc;
 #define ORm         OP(ORm)      FLAGS_OR_(CPU_RB_PC); ++gb->pc;
-#define CPm         OP(CPm)      tmp -= CPU_RB_PC; ++gb->pc; FLAGS_CP;
+#define CPm         OP(CPm)      { const uint8_t val = CPU_RB_PC; ++gb->pc; tmp -= val; FLAGS_CP }
 
+#ifdef USE_LAZY_FLAGS
+#define INC(X)      OP(INC)      FLAGS_LAZY (LAZY_INC, 0, X | (FLAG_C << 8))
+#define DEC(X)      OP(DEC)      FLAGS_LAZY (LAZY_DEC, 0, X | (FLAG_C << 8))
+#else
 #define INC(X)      OP(INC)      SET_FLAGS (16, X, 0, ((X & 0xF) == 0),   0);
 #define DEC(X)      OP(DEC)      SET_FLAGS (16, X, 1, ((X & 0xF) == 0xF), 0);
+#endif
 
-#define CCF         OP(CCF)      gb->f_c = !gb->f_c; gb->f_n = gb->f_h = 0;
-#define SCF         OP(SCF)      gb->f_c = 1;        gb->f_n = gb->f_h = 0;
-#define CPL         OP(CPL)      REG_A ^= 0xFF; gb->flags |= 0x60;
+#define CCF         OP(CCF)      FLAGS_SYNC gb->f_c = !gb->f_c; gb->f_n = gb->f_h = 0;
+#define SCF         OP(SCF)      FLAGS_SYNC gb->f_c = 1;        gb->f_n = gb->f_h = 0;
+#define CPL         OP(CPL)      FLAGS_SYNC REG_A ^= 0xFF; gb->flags |= 0x60;
 
 #define INC_r8(reg, _)  OP(INC)  reg++; INC(reg)
 #define DEC_r8(reg, _)  OP(DEC)  reg--; DEC(reg)
@@ -206,6 +329,7 @@
 /* The following is from SameBoy. MIT License. */
 #define DAA      OP(DAA);     {\
     int16_t a = REG_A;\
+    FLAGS_SYNC\
     if (gb->f_n) {\
         if (gb->f_h) a = (a - 0x06) & 0xFF;\
         if (gb->f_c) a -= 0x60;\
@@ -222,8 +346,8 @@
 /** 16-bit arithmetic instructions **/
 
     /* Flag templates for Add HL instructions */
-    #define FLAGS_ADHL  gb->f_n = 0;   gb->f_h = ((REG_HL & 0xfff) > (gb->nn & 0xfff)); gb->f_c = (REG_HL > gb->nn) ? 1 : 0;
-    #define FLAGS_SPm   gb->flags = 0; gb->f_h = ((gb->sp & 0xF) + (i & 0xF) > 0xF); gb->f_c = ((gb->sp & 0xFF) + (i & 0xFF) > 0xFF);
+    #define FLAGS_ADHL  FLAGS_SYNC gb->f_n = 0;   gb->f_h = ((REG_HL & 0xfff) > (gb->nn & 0xfff)); gb->f_c = (REG_HL > gb->nn) ? 1 : 0;
+    #define FLAGS_SPm   FLAGS_RESET gb->f_h = ((gb->sp & 0xF) + (i & 0xF) > 0xF); gb->f_c = ((gb->sp & 0xFF) + (i & 0xFF) > 0xFF);
 
 #define ADHLrr(r16)   OP(ADHLrr); {\
     gb->nn = REG_HL + r16; INC_MCYCLE; FLAGS_ADHL; REG_HL = gb->nn;\
@@ -233,7 +357,7 @@
     const int8_t i = (int8_t) CPU_RB_PC; ++gb->pc; INC_MCYCLE; FLAGS_SPm; INC_MCYCLE; gb->sp += i; }
 
 #define LDHLSP   OP(LDHLSP)   { const int8_t i = (int8_t) CPU_RB_PC;\
-    ++gb->pc; INC_MCYCLE; gb->flags = 0;\
+    ++gb->pc; INC_MCYCLE; FLAGS_RESET\
     gb->f_h = ((gb->sp & 0xF) + (i & 0xF) > 0xF);\
     gb->f_c = ((gb->sp & 0xFF) + (i & 0xFF) > 0xFF);\
     REG_H = ((gb->sp + i) >> 8); REG_L = (gb->sp + i) & 0xFF;\
@@ -252,14 +376,14 @@
 /** Jump and call instructions **/
 
 /* Jump to | relative jump */
-#define JPNN    OP(JPNN)  gb->pc = CPU_RW (gb->pc); INC_MCYCLE;
+#define JPNN    OP(JPNN)  gb->pc = CPU_RW_PC; INC_MCYCLE;
 #define JPHL    OP(JPHL)  gb->pc = REG_HL; 
-#define JRm     OP(JRm)   const int8_t inc = (int8_t) CPU_RB (gb->pc);\
+#define JRm     OP(JRm)   const int8_t inc = (int8_t) CPU_RB_PC;\
     gb->pc += inc; if(!gb->pcInc) { gb->pc--; gb->pcInc = 1; } ++gb->pc; INC_MCYCLE;\
 
 /* Calls */
 #define CALLm   OP(CALLm);  {\
-    gb->nn = CPU_RW (gb->pc); ++gb->pc; ++gb->pc; gb->sp -= 2;\
+    gb->nn = CPU_RW_PC; ++gb->pc; ++gb->pc; gb->sp -= 2;\
     CPU_WW(gb->sp, gb->pc); gb->pc = gb->nn; INC_MCYCLE; }\
 
     /* Return function template */
@@ -270,15 +394,15 @@
 
     /* Conditional function templates */
     #define JP_IF(X) \
-        gb->nn = CPU_RW (gb->pc); ++gb->pc; ++gb->pc;\
+        gb->nn = CPU_RW_PC; ++gb->pc; ++gb->pc;\
         if (X) { gb->pc = gb->nn ; INC_MCYCLE; }\
 
     #define JR_IF(X) \
-        int8_t e = (int8_t) CPU_RB (gb->pc); ++gb->pc;\
+        int8_t e = (int8_t) CPU_RB_PC; ++gb->pc;\
         if (X) { if (!gb->pcInc) { e--; gb->pcInc = 1; } gb->pc += e; INC_MCYCLE; }\
 
     #define CALL_IF(X) \
-        gb->nn = CPU_RW (gb->pc); ++gb->pc; ++gb->pc;\
+        gb->nn = CPU_RW_PC; ++gb->pc; ++gb->pc;\
         if (X) { PUSH_(gb->pc >> 8, gb->pc & 0xFF);\
             gb->pc = gb->nn; }\
 
@@ -287,9 +411,9 @@
 /* Conditional jump, relative jump, return, call */
 
 #define COND_(_)\
-    (_ == 0) ? (!gb->f_z) :\
-    (_ == 1) ?   gb->f_z  :\
-    (_ == 2) ? (!gb->f_c) : gb->f_c\
+    (_ == 0) ? (!FLAG_Z) :\
+    (_ == 1) ?   FLAG_Z  :\
+    (_ == 2) ? (!FLAG_C) : FLAG_C\
 
 #define JR_(C)    OP(JR_)     { JR_IF   (COND_(C)) }
 #define RET_(C)   OP(RET_)    { RET_IF  (COND_(C)) }
@@ -298,12 +422,51 @@
 
 #define RST       OP(RST)    gb->sp -= 2; INC_MCYCLE; CPU_WW (gb->sp, gb->pc); gb->pc = op & 0x38;
 
+/** Fused op pairs (USE_OP_FUSION) **/
+
+/* A pair runs in one dispatch only if no event could come before it
+   ends, so none would have run between its ops. Otherwise the first op
+   runs on its own, from opTable. */
+#define FUSE_SAFE(cycles)  (gb->clock_t + (gb->rm + (cycles)) * 4 < gb->nextEvent)
+
+/* Move the running block past the second op of the pair */
+#define FUSE_NEXT(len)\
+    gb->fetchOp++; gb->fetchPC = gb->blockPC; gb->blockPC += len;\
+    gb->blockIdx++; gb->pc += len;
+
+/* DEC r; JR cc,e. 3 M-cycles, and 1 more for a taken branch */
+#define FUSE_DEC_JR(reg)  OP(DEC_JR) {\
+    const struct gb_block_op * const jr = gb->fetchOp + 1;\
+    const uint8_t cond = (jr->bytes[0] >> 3) & 3;\
+    if (!FUSE_SAFE (3)) goto *opTable[op];\
+    reg--; DEC(reg)\
+    FUSE_NEXT (2)\
+    gb->rm += 2;\
+    if (COND_(cond)) { gb->pc += (int8_t) jr->bytes[1]; gb->rm++; }\
+}
+
+/* LD A,(rr); LD (rr),A between directly mapped pages. 4 M-cycles */
+#define FUSE_LD_COPY  OP(LD_COPY) {\
+    const uint8_t st = gb->fetchOp[1].bytes[0];\
+    uint16_t hl = REG_HL, from, to;\
+    from = (op < 0x20) ? ((op & 0x10) ? REG_DE : REG_BC) : hl;\
+    hl += (op > 0x30) ? -1 : (op > 0x20) ? 1 : 0;\
+    to = (st < 0x20) ? ((st & 0x10) ? REG_DE : REG_BC) : hl;\
+    hl += (st > 0x30) ? -1 : (st > 0x20) ? 1 : 0;\
+    if (!FUSE_SAFE (3) || !gb->readPage[from >> 8] || !gb->writePage[to >> 8])\
+        goto *opTable[op];\
+    REG_A = gb->writePage[to >> 8][to & 0xFF] = gb->readPage[from >> 8][from & 0xFF];\
+    REG_HL = hl;\
+    FUSE_NEXT (1)\
+    gb->rm += 3;\
+}
+
 /* Rotate and shift instructions */
 
-#define RLA   	OP(RLA)   { gb->nn = REG_A; REG_A = (REG_A << 1) | (gb->f_c);      gb->flags = 0; gb->f_c = ((gb->nn >> 7) & 1); }
-#define RRA     OP(RRA)   { gb->nn = REG_A; REG_A = (REG_A >> 1) | (gb->f_c << 7); gb->flags = 0; gb->f_c = (gb->nn & 1); }
-#define RLCA    OP(RLCA)  REG_A = (REG_A << 1) | (REG_A >> 7); gb->flags = 0; gb->f_c = (REG_A & 1); 
-#define RRCA    OP(RRCA)  gb->flags = 0; gb->f_c = (REG_A & 1); REG_A = (REG_A >> 1) | (REG_A << 7); 
+#define RLA   	OP(RLA)   { gb->nn = REG_A; REG_A = (REG_A << 1) | (FLAG_C);      FLAGS_RESET gb->f_c = ((gb->nn >> 7) & 1); }
+#define RRA     OP(RRA)   { gb->nn = REG_A; REG_A = (REG_A >> 1) | (FLAG_C << 7); FLAGS_RESET gb->f_c = (gb->nn & 1); }
+#define RLCA    OP(RLCA)  REG_A = (REG_A << 1) | (REG_A >> 7); FLAGS_RESET gb->f_c = (REG_A & 1); 
+#define RRCA    OP(RRCA)  FLAGS_RESET gb->f_c = (REG_A & 1); REG_A = (REG_A >> 1) | (REG_A << 7); 
 
 #define RLC(X)  OP(RLC) {\
     gb->nn = X;\
@@ -313,7 +476,7 @@
 
 #define RL(X)   OP(RL) {\
     gb->nn = X;\
-    X <<= 1; X |= gb->f_c;\
+    X <<= 1; X |= FLAG_C;\
     SET_FLAGS(0, X, 0, 0, (gb->nn >> 7));\
 }
 
@@ -325,12 +488,12 @@
 
 #define RR(X)   OP(RR) {\
     gb->nn = X;\
-    X >>= 1; X |= gb->f_c << 7;\
+    X >>= 1; X |= FLAG_C << 7;\
     SET_FLAGS(0, X, 0, 0, (gb->nn & 1));\
 }
 
-#define SLA(X)  OP(SLA)   gb->flags = 0; SET_FLAG_C (X >> 7); X <<= 1; SET_FLAG_Z (X);
-#define SRA(X)  OP(SRA)   gb->flags = 0; SET_FLAG_C (X & 1); X = (X >> 1) | (X & 0X80); SET_FLAG_Z(X);
+#define SLA(X)  OP(SLA)   FLAGS_RESET SET_FLAG_C (X >> 7); X <<= 1; SET_FLAG_Z (X);
+#define SRA(X)  OP(SRA)   FLAGS_RESET SET_FLAG_C (X & 1); X = (X >> 1) | (X & 0X80); SET_FLAG_Z(X);
 
 #define SWAP(X) OP(SWAP) {\
     X = ((0xF0 & (X << 4)) | (0x0F & (X >> 4)));\
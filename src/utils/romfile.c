@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "romfile.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define ROM_FILE_MMAP
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+struct RomFile
+{
+    uint8_t * data;
+    size_t    size;
+    uint32_t  refs;
+#ifdef ROM_FILE_MMAP
+    dev_t     dev; /* Identifies the file, for sharing its image */
+    ino_t     ino;
+#endif
+    struct RomFile * next;
+};
+
+/* Images currently open */
+static struct RomFile * romFiles = NULL;
+
+#ifdef ROM_FILE_MMAP
+
+/* Map the file, or read it into zeroed memory if it's smaller than the
+   banks that are always mapped */
+
+static uint8_t * rom_file_map (const int fd, const size_t size)
+{
+    int flags = MAP_PRIVATE;
+    uint8_t * data;
+
+    if (size < ROM_FILE_BANKS)
+    {
+        data = mmap (NULL, ROM_FILE_BANKS, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            return NULL;
+        if (read (fd, data, size) != (ssize_t) size ||
+            mprotect (data, ROM_FILE_BANKS, PROT_READ) < 0)
+        {
+            munmap (data, ROM_FILE_BANKS);
+            return NULL;
+        }
+        return data;
+    }
+#if defined(USE_ROM_POPULATE) && defined(MAP_POPULATE)
+    flags |= MAP_POPULATE; /* Fault in all pages now instead of on access */
+#endif
+    data = mmap (NULL, size, PROT_READ, flags, fd, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+#if !defined(USE_ROM_POPULATE) && defined(MADV_WILLNEED)
+    madvise (data, size, MADV_WILLNEED);
+#endif
+    return data;
+}
+
+static struct RomFile * rom_file_load (const char * fileName)
+{
+    struct RomFile * rf;
+    struct stat st;
+
+    const int fd = open (fileName, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat (fd, &st) < 0 || st.st_size < ROM_FILE_MIN)
+    {
+        close (fd);
+        return NULL;
+    }
+
+    /* Share the image if the same file is already open */
+    for (rf = romFiles; rf; rf = rf->next)
+    {
+        if (rf->dev == st.st_dev && rf->ino == st.st_ino)
+        {
+            close (fd);
+            rf->refs++;
+            return rf;
+        }
+    }
+
+    const size_t size = (st.st_size < ROM_FILE_BANKS) ? ROM_FILE_BANKS : st.st_size;
+    uint8_t * const data = rom_file_map (fd, st.st_size);
+    close (fd);
+
+    if (!data)
+        return NULL;
+
+    rf = malloc (sizeof (struct RomFile));
+    if (!rf)
+    {
+        munmap (data, size);
+        return NULL;
+    }
+    rf->data = data;
+    rf->size = size;
+    rf->refs = 1;
+    rf->dev  = st.st_dev;
+    rf->ino  = st.st_ino;
+    rf->next = romFiles;
+    romFiles = rf;
+
+    return rf;
+}
+
+#else
+
+/* Without mmap, each instance reads its own copy */
+
+static struct RomFile * rom_file_load (const char * fileName)
+{
+    FILE * f = fopen (fileName, "rb");
+    if (!f)
+        return NULL;
+
+    struct RomFile * rf = malloc (sizeof (struct RomFile));
+    fseek (f, 0, SEEK_END);
+    const long fileSize = ftell (f);
+    fseek (f, 0, SEEK_SET);
+
+    if (!rf || fileSize < ROM_FILE_MIN)
+    {
+        fclose (f);
+        free (rf);
+        return NULL;
+    }
+    rf->size = (fileSize < ROM_FILE_BANKS) ? ROM_FILE_BANKS : fileSize;
+    rf->data = calloc (rf->size, 1);
+    if (!rf->data || !fread (rf->data, fileSize, 1, f))
+    {
+        fclose (f);
+        free (rf->data);
+        free (rf);
+        return NULL;
+    }
+    fclose (f);
+
+    rf->refs = 1;
+    rf->next = romFiles;
+    romFiles = rf;
+
+    return rf;
+}
+
+#endif
+
+/* Open a ROM image, or get the one already open for the same file */
+
+uint8_t * rom_file_open (const char * fileName, size_t * size)
+{
+    const struct RomFile * const rf = rom_file_load (fileName);
+    if (!rf)
+        return NULL;
+
+    if (size)
+        *size = rf->size;
+    return rf->data;
+}
+
+/* Release an image, which is unmapped once no instance uses it */
+
+void rom_file_close (const uint8_t * data)
+{
+    struct RomFile ** link = &romFiles;
+
+    while (*link && (*link)->data != data)
+        link = &(*link)->next;
+    if (!*link)
+        return;
+
+    struct RomFile * const rf = *link;
+    if (--rf->refs > 0)
+        return;
+
+    *link = rf->next;
+#ifdef ROM_FILE_MMAP
+    munmap (rf->data, rf->size);
+#else
+    free (rf->data);
+#endif
+    free (rf);
+}
@@ -0,0 +1,22 @@
+#ifndef ROMFILE_H
+#define ROMFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Read-only ROM images. Where mmap is available the file is mapped
+   privately, so every instance running the same title shares its pages.
+   Opening a file that is already open returns the same image, which is
+   released when the last instance closes it. Not thread safe.
+
+   Files too small to hold the cartridge header fail to open. Smaller
+   ones than the two banks always mapped are read into zeroed memory of
+   that size, which is the size returned. */
+
+#define ROM_FILE_MIN    0x150  /* Header ends here                   */
+#define ROM_FILE_BANKS  0x8000 /* Banks 0 and 1, mapped at 0000-7FFF */
+
+uint8_t * rom_file_open  (const char * fileName, size_t * size);
+void      rom_file_close (const uint8_t * data);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "savefile.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define SAVE_FILE_MMAP
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+/* Open or create a save file, with at least size bytes. Existing data is
+   kept, and a new or shorter file is padded with zeros */
+
+uint8_t save_file_open (struct SaveFile * save, const char * fileName, const size_t size)
+{
+    save->data = NULL;
+    save->size = size;
+#ifdef SAVE_FILE_MMAP
+    struct stat st;
+
+    const int fd = open (fileName, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return 0;
+
+    if (fstat (fd, &st) < 0 || ((size_t)st.st_size < size && ftruncate (fd, size) < 0))
+    {
+        close (fd);
+        return 0;
+    }
+    void * const data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (data == MAP_FAILED)
+        return 0;
+    save->data = data;
+#else
+    strncpy (save->fileName, fileName, sizeof (save->fileName) - 1);
+    save->fileName[sizeof (save->fileName) - 1] = '\0';
+
+    save->data = calloc (size, sizeof (uint8_t));
+    size_t read = 0;
+    FILE * f = fopen (fileName, "rb");
+    if (f)
+    {
+        read = fread (save->data, sizeof (uint8_t), size, f);
+        fclose (f);
+    }
+    /* Pad the file up front so block writes never leave a short file */
+    if (read < size && (f = fopen (fileName, "wb")))
+    {
+        fwrite (save->data, sizeof (uint8_t), size, f);
+        fclose (f);
+    }
+#endif
+    return 1;
+}
+
+/* Write back the blocks marked in the dirty bitmap, clearing each mark
+   as its block is handled. The last block may be shorter than the rest.
+   Unless asked to wait, this only schedules the write where mmap is used */
+
+void save_file_sync (struct SaveFile * save, uint8_t * dirty, const uint8_t wait)
+{
+    const size_t blocks = (save->size + SAVE_BLOCK_SIZE - 1) / SAVE_BLOCK_SIZE;
+    size_t i;
+
+    if (!save->data)
+        return;
+#ifdef SAVE_FILE_MMAP
+    /* msync works on whole pages, so flush each page with a dirty block */
+    const size_t pageBlocks = sysconf (_SC_PAGESIZE) / SAVE_BLOCK_SIZE;
+    size_t j;
+
+    for (i = 0; i < blocks; i++)
+    {
+        if (!(dirty[i >> 3] & (1 << (i & 7))))
+            continue;
+
+        const size_t first = i - (i % pageBlocks);
+        const size_t start = first * SAVE_BLOCK_SIZE;
+        const size_t len   = (save->size - start < pageBlocks * SAVE_BLOCK_SIZE) ?
+            save->size - start : pageBlocks * SAVE_BLOCK_SIZE;
+
+        msync (save->data + start, len, wait ? MS_SYNC : MS_ASYNC);
+
+        /* The whole page went out, so clear its blocks and go to the next */
+        for (j = first; j < first + pageBlocks && j < blocks; j++)
+            dirty[j >> 3] &= ~(1 << (j & 7));
+        i = first + pageBlocks - 1;
+    }
+#else
+    FILE * f = fopen (save->fileName, "r+b");
+    if (!f)
+        return;
+
+    for (i = 0; i < blocks; i++)
+    {
+        if (!(dirty[i >> 3] & (1 << (i & 7))))
+            continue;
+
+        const size_t len = (i == blocks - 1) ? save->size - i * SAVE_BLOCK_SIZE : SAVE_BLOCK_SIZE;
+        fseek (f, i * SAVE_BLOCK_SIZE, SEEK_SET);
+        if (fwrite (save->data + i * SAVE_BLOCK_SIZE, len, 1, f) == 1)
+            dirty[i >> 3] &= ~(1 << (i & 7));
+    }
+    fclose (f);
+#endif
+}
+
+/* Flush any changes and release the save */
+
+void save_file_close (struct SaveFile * save, uint8_t * dirty)
+{
+    if (!save->data)
+        return;
+
+    save_file_sync (save, dirty, 1);
+#ifdef SAVE_FILE_MMAP
+    munmap (save->data, save->size);
+#else
+    free (save->data);
+#endif
+    save->data = NULL;
+}
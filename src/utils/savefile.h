@@ -0,0 +1,26 @@
+#ifndef SAVEFILE_H
+#define SAVEFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SAVE_BLOCK_SIZE  256 /* Bytes covered by each bit of a dirty bitmap */
+
+/* Battery-backed RAM stored in a file. Where mmap is available the file
+   is mapped shared and changes reach it through the page cache, so
+   syncing only asks for dirty pages to be written back */
+
+struct SaveFile
+{
+    uint8_t * data;
+    size_t    size;
+#if !(defined(__unix__) || defined(__APPLE__))
+    char      fileName[256];
+#endif
+};
+
+uint8_t save_file_open  (struct SaveFile *, const char * fileName, const size_t size);
+void    save_file_sync  (struct SaveFile *, uint8_t * dirty, const uint8_t wait);
+void    save_file_close (struct SaveFile *, uint8_t * dirty);
+
+#endif
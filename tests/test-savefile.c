@@ -0,0 +1,49 @@
+#include <criterion/criterion.h>
+#include <criterion/new/assert.h>
+#include <stdio.h>
+
+#include "../src/utils/savefile.h"
+
+#define SAVE_TEST_FILE "tests/test-savefile.sav"
+
+/* Mark the last block, which is shorter than the rest, and sync it. The
+   sizes are an RTC footer alone and 8 KiB of RAM followed by a footer */
+
+static void sync_partial_block(const size_t size)
+{
+    struct SaveFile save;
+    uint8_t dirty[8] = {0};
+    uint8_t last = 0;
+    const size_t block = (size - 1) / SAVE_BLOCK_SIZE;
+
+    remove(SAVE_TEST_FILE);
+    cr_assert(save_file_open(&save, SAVE_TEST_FILE, size));
+
+    save.data[size - 1] = 0xA5;
+    dirty[block >> 3] |= 1 << (block & 7);
+    save_file_sync(&save, dirty, 1);
+    cr_assert(eq(u8, dirty[block >> 3], 0));
+
+    save_file_close(&save, dirty);
+
+    FILE *f = fopen(SAVE_TEST_FILE, "rb");
+    cr_assert(f != NULL);
+    fseek(f, size - 1, SEEK_SET);
+    cr_assert(eq(sz, fread(&last, 1, 1, f), 1));
+    fclose(f);
+    remove(SAVE_TEST_FILE);
+
+    cr_assert(eq(u8, last, 0xA5));
+}
+
+Test(save_sync, rtc_only, .timeout = 5)
+{
+    cr_log_info("Syncing a 48-byte save...\n");
+    sync_partial_block(48);
+}
+
+Test(save_sync, ram_and_rtc, .timeout = 5)
+{
+    cr_log_info("Syncing an 8240-byte save...\n");
+    sync_partial_block(8 * 1024 + 48);
+}